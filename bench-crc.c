@@ -0,0 +1,123 @@
+/* benchmark for the HM-MOD-UART CRC16
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc16.h"
+
+#define BENCH_BYTES	(64 * 1024 * 1024)	/* per size and implementation */
+
+static volatile uint16_t sink;	/* keeps the loops from being optimized out */
+
+/* What hmuartlgw.c used before the tables */
+static uint16_t crc16_bitwise(uint16_t crc, const uint8_t *buf, int len)
+{
+	int i, j;
+
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i] << 8;
+		for (j = 0; j < 8; j++) {
+			if (crc & 0x8000) {
+				crc <<= 1;
+				crc ^= CRC16_POLY;
+			} else {
+				crc <<= 1;
+			}
+		}
+	}
+
+	return crc;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void bench(char *name, uint16_t (*fn)(uint16_t, const uint8_t*, int), uint8_t *buf, int len)
+{
+	uint16_t crc = CRC16_INIT;
+	long rounds = BENCH_BYTES / len;
+	double start, secs;
+	long i;
+
+	if (fn == crc16_bitwise)
+		rounds /= 8;
+
+	start = now();
+	for (i = 0; i < rounds; i++)
+		crc = fn(crc, buf, len);
+	secs = now() - start;
+	sink = crc;
+
+	printf("%-8s %5d bytes: %8.1f MB/s, %10.0f frames/s\n", name, len,
+	       (rounds * len) / secs / 1e6, rounds / secs);
+}
+
+int main(void)
+{
+	int sizes[] = { 10, 60, 256, 2048, 4096 };
+	uint8_t *buf;
+	int i;
+
+	buf = malloc(4096);
+	if (!buf) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	srand(1);
+	for (i = 0; i < 4096; i++)
+		buf[i] = rand();
+
+	crc16_init();
+
+	for (i = 0; i < 4096; i += 509) {
+		if ((crc16_slice4(CRC16_INIT, buf, i) != crc16_bitwise(CRC16_INIT, buf, i)) ||
+		    (crc16_clmul(CRC16_INIT, buf, i) != crc16_bitwise(CRC16_INIT, buf, i))) {
+			fprintf(stderr, "CRC mismatch at %d bytes!\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	printf("carry-less multiply: %s\n", crc16_have_clmul() ? "yes" : "no");
+
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		bench("bitwise", crc16_bitwise, buf, sizes[i]);
+		bench("slice4", crc16_slice4, buf, sizes[i]);
+		if (crc16_have_clmul())
+			bench("clmul", crc16_clmul, buf, sizes[i]);
+		bench("crc16", crc16, buf, sizes[i]);
+	}
+
+	free(buf);
+
+	return EXIT_SUCCESS;
+}
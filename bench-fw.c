@@ -0,0 +1,259 @@
+/* benchmark for the firmware loader
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "firmware.h"
+
+#define BENCH_ROUNDS	20
+#define BENCH_BLOCKS	256	/* full blocks, more than any released image has */
+#define BENCH_BLOCK_LEN	2048
+
+static int devnull = -1;
+static int saved_stdout = -1;
+
+/* The loaders report progress on stdout, keep that out of the timing */
+static void quiet(int on)
+{
+	fflush(stdout);
+	if (on) {
+		saved_stdout = dup(STDOUT_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+	} else {
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+	}
+}
+
+/* What firmware.c did before the single arena loader: two read()s, a
+ * realloc() and a malloc() per block, hex decoded nibble by nibble */
+static struct firmware* old_read_firmware(char *filename)
+{
+	struct firmware *fw;
+	uint8_t buf[4096];
+	uint16_t len;
+	int fd;
+	int r;
+	int i;
+
+	fw = malloc(sizeof(struct firmware));
+	if (!fw) {
+		perror("malloc(fw)");
+		exit(EXIT_FAILURE);
+	}
+	memset(fw, 0, sizeof(struct firmware));
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while ((r = read(fd, buf, 4)) == 4) {
+		len = (ascii_to_nibble(buf[0]) << 12) | (ascii_to_nibble(buf[1]) << 8) |
+		      (ascii_to_nibble(buf[2]) << 4) | ascii_to_nibble(buf[3]);
+
+		fw->fw = realloc(fw->fw, sizeof(uint8_t*) * (fw->fw_blocks + 1));
+		fw->fw[fw->fw_blocks] = malloc(len + 4);
+		if ((!fw->fw) || (!fw->fw[fw->fw_blocks])) {
+			perror("Can't allocate memory for firmware");
+			exit(EXIT_FAILURE);
+		}
+
+		fw->fw[fw->fw_blocks][0] = (fw->fw_blocks >> 8) & 0xff;
+		fw->fw[fw->fw_blocks][1] = fw->fw_blocks & 0xff;
+		fw->fw[fw->fw_blocks][2] = (len >> 8) & 0xff;
+		fw->fw[fw->fw_blocks][3] = len & 0xff;
+
+		if (read(fd, buf, len * 2) != len * 2) {
+			fprintf(stderr, "short read, aborting\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < len * 2; i++) {
+			if (!validate_nibble(buf[i])) {
+				fprintf(stderr, "Firmware file not valid!\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		for (i = 0; i < len; i++)
+			fw->fw[fw->fw_blocks][i + 4] = (ascii_to_nibble(buf[i * 2]) << 4) | ascii_to_nibble(buf[(i * 2) + 1]);
+
+		fw->fw_blocks++;
+	}
+
+	close(fd);
+
+	return fw;
+}
+
+static void old_free(struct firmware *fw)
+{
+	int i;
+
+	for (i = 0; i < fw->fw_blocks; i++)
+		free(fw->fw[i]);
+	free(fw->fw);
+	free(fw);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void write_image(char *filename)
+{
+	char hex[4 + (BENCH_BLOCK_LEN * 2)];
+	uint8_t block[BENCH_BLOCK_LEN];
+	FILE *f;
+	int i, j;
+
+	f = fopen(filename, "w");
+	if (!f) {
+		perror(filename);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < BENCH_BLOCKS; i++) {
+		for (j = 0; j < BENCH_BLOCK_LEN; j++)
+			block[j] = rand();
+		snprintf(hex, sizeof(hex), "%04X", BENCH_BLOCK_LEN);
+		hex_encode(hex + 4, block, BENCH_BLOCK_LEN);
+		fwrite(hex, sizeof(hex), 1, f);
+	}
+
+	if (fclose(f)) {
+		perror(filename);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void report(char *name, double secs, off_t size)
+{
+	printf("%-16s %8.2f ms/image, %8.1f MB/s\n", name,
+	       (secs * 1000) / BENCH_ROUNDS, (size * BENCH_ROUNDS) / secs / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	char image[] = "/tmp/bench-fw-XXXXXX";
+	char cache_dir[] = "/tmp/bench-fw-cache-XXXXXX";
+	char cache_file[1024];
+	struct firmware *fw, *old;
+	double start;
+	off_t size;
+	char *filename;
+	int fd;
+	int i;
+
+	devnull = open("/dev/null", O_WRONLY);
+	if ((devnull < 0) || (!mkdtemp(cache_dir))) {
+		perror("bench-fw");
+		exit(EXIT_FAILURE);
+	}
+
+	if (argc > 1) {
+		filename = argv[1];
+	} else {
+		fd = mkstemp(image);
+		if (fd < 0) {
+			perror("mkstemp");
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+		srand(1);
+		write_image(image);
+		filename = image;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	size = lseek(fd, 0, SEEK_END);
+	close(fd);
+
+	old = old_read_firmware(filename);
+	quiet(1);
+	fw = firmware_read_firmware(filename, 0);
+	quiet(0);
+	if (fw->fw_blocks != old->fw_blocks) {
+		fprintf(stderr, "Loaders disagree on the number of blocks!\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < fw->fw_blocks; i++) {
+		if (memcmp(fw->fw[i], old->fw[i], ((old->fw[i][2] << 8) | old->fw[i][3]) + 4)) {
+			fprintf(stderr, "Loaders disagree on block %d!\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	snprintf(cache_file, sizeof(cache_file), "%s/%016" PRIx64 ".hmfw", cache_dir, fw->hash);
+	printf("%s: %d blocks, %ld bytes\n", filename, fw->fw_blocks, (long)size);
+	old_free(old);
+	firmware_free(fw);
+
+	start = now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		old_free(old_read_firmware(filename));
+	report("per-block", now() - start, size);
+
+	quiet(1);
+	start = now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		firmware_free(firmware_read_firmware(filename, 0));
+	quiet(0);
+	report("arena", now() - start, size);
+
+	/* The first load fills the cache, all others are hits */
+	setenv("HMCFGUSB_FW_CACHE", cache_dir, 1);
+	quiet(1);
+	firmware_free(firmware_read_firmware(filename, 0));
+	start = now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		firmware_free(firmware_read_firmware(filename, 0));
+	quiet(0);
+	report("arena, cached", now() - start, size);
+
+	unlink(cache_file);
+	rmdir(cache_dir);
+	if (filename == image)
+		unlink(image);
+
+	return EXIT_SUCCESS;
+}
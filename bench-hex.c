@@ -0,0 +1,272 @@
+/* benchmark for the HMLAN frame formatter and the hex codec
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+#include "hmlan.h"
+
+#define BENCH_FRAMES	2000000	/* per frame size and implementation */
+
+static volatile int sink;	/* keeps the loops from being optimized out */
+
+#define CHECK_SPACE(x)		if ((*outpos + x) > outend) { fprintf(stderr, "Not enough space!\n"); return 0; }
+#define CHECK_AVAIL(x)		if ((*inpos + x) > inend) { fprintf(stderr, "Not enough input available!\n"); return 0; }
+
+/* What hmland.c used before the descriptor tables */
+static int old_format_part_out(uint8_t **inpos, int inlen, uint8_t **outpos, int outlen, int len, int flags)
+{
+	uint8_t *buf_out = *outpos;
+	uint8_t *outend = *outpos + outlen;
+	uint8_t *inend = *inpos + inlen;
+	int i;
+
+	if (flags & FLAG_COMMA_BEFORE) {
+		CHECK_SPACE(1);
+		**outpos=',';
+		*outpos += 1;
+	}
+
+	if (flags & FLAG_LENGTH_BYTE) {
+		CHECK_AVAIL(1);
+		len = **inpos;
+		*inpos += 1;
+	}
+
+	if (flags & FLAG_FORMAT_HEX) {
+		CHECK_AVAIL(len);
+		CHECK_SPACE(len*2);
+		for (i = 0; i < len; i++) {
+			**outpos = nibble_to_ascii(((**inpos) & 0xf0) >> 4);
+			*outpos += 1;
+			**outpos = nibble_to_ascii(((**inpos) & 0xf));
+			*inpos += 1; *outpos += 1;
+		}
+	} else {
+		CHECK_AVAIL(len);
+		CHECK_SPACE(len);
+		memcpy(*outpos, *inpos, len);
+		*outpos += len;
+		*inpos += len;
+	}
+
+	if (flags & FLAG_COMMA_AFTER) {
+		CHECK_SPACE(1);
+		**outpos=',';
+		*outpos += 1;
+	}
+
+	if (flags & FLAG_NL) {
+		CHECK_SPACE(2);
+		**outpos='\r';
+		*outpos += 1;
+		**outpos='\n';
+		*outpos += 1;
+	}
+
+	return *outpos - buf_out;
+}
+
+/* 'E' and 'R' share the layout apart from the first field */
+static int old_format_out(uint8_t *buf, int buf_len, uint8_t *out, int outlen)
+{
+	uint8_t *outpos;
+	uint8_t *inpos;
+
+	memset(out, 0, outlen);
+	outpos = out;
+	inpos = buf;
+
+	old_format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (outlen-(outpos-out)), 1, 0);
+	old_format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (outlen-(outpos-out)), (buf[0] == 'E') ? 3 : 4, FLAG_FORMAT_HEX);
+	old_format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (outlen-(outpos-out)), 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
+	old_format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (outlen-(outpos-out)), 4, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
+	old_format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (outlen-(outpos-out)), 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
+	old_format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (outlen-(outpos-out)), 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
+	old_format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (outlen-(outpos-out)), 0, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_LENGTH_BYTE | FLAG_NL);
+
+	return outpos - out;
+}
+
+static int new_format_out(uint8_t *buf, int buf_len, uint8_t *out, int outlen)
+{
+	return format_frame((buf[0] == 'E') ? format_e : format_r, buf, buf_len, out, outlen);
+}
+
+/* What util.c offered before hex_encode()/hex_decode_validate() */
+static int old_hex_encode(uint8_t *out, const uint8_t *in, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		out[i * 2] = nibble_to_ascii((in[i] & 0xf0) >> 4);
+		out[(i * 2) + 1] = nibble_to_ascii(in[i] & 0xf);
+	}
+
+	return len * 2;
+}
+
+static int old_hex_decode_validate(uint8_t *out, const uint8_t *in, int len)
+{
+	int i;
+
+	for (i = 0; i < len / 2; i++) {
+		if ((!validate_nibble(in[i * 2])) || (!validate_nibble(in[(i * 2) + 1])))
+			break;
+		out[i] = (ascii_to_nibble(in[i * 2]) << 4) | ascii_to_nibble(in[(i * 2) + 1]);
+	}
+
+	return i;
+}
+
+static int new_hex_encode(uint8_t *out, const uint8_t *in, int len)
+{
+	return hex_encode((char*)out, in, len);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/* Like the HM-CFG-USB sends them: header fields, length byte, message */
+static int make_frame(uint8_t *frame, char type, int msglen)
+{
+	int hdrlen = (type == 'E') ? 14 : 15;
+	int i;
+
+	frame[0] = type;
+	for (i = 1; i < hdrlen - 1; i++)
+		frame[i] = rand();
+	frame[hdrlen - 1] = msglen;
+	for (i = 0; i < msglen; i++)
+		frame[hdrlen + i] = rand();
+
+	return hdrlen + msglen;
+}
+
+static void bench_format(char *name, int (*fn)(uint8_t*, int, uint8_t*, int), uint8_t *frame, int len)
+{
+	uint8_t out[1024];
+	double start, secs;
+	long i;
+
+	start = now();
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		frame[len - 1] = i;
+		sink += fn(frame, len, out, sizeof(out));
+	}
+	secs = now() - start;
+
+	printf("%-12s %c frame, %2d byte message: %10.0f frames/s\n", name, frame[0],
+	       frame[frame[0] == 'E' ? 13 : 14], BENCH_FRAMES / secs);
+}
+
+static void bench_codec(char *name, int (*fn)(uint8_t*, const uint8_t*, int), const uint8_t *in, int len)
+{
+	uint8_t out[4096];
+	long rounds = (BENCH_FRAMES * 32L) / len;
+	double start, secs;
+	long i;
+
+	start = now();
+	for (i = 0; i < rounds; i++) {
+		out[0] = i;
+		sink += fn(out, in, len);
+	}
+	secs = now() - start;
+
+	printf("%-12s %4d bytes in: %8.1f MB/s, %10.0f calls/s\n", name, len,
+	       (rounds * len) / secs / 1e6, rounds / secs);
+}
+
+static void bench_hex(void)
+{
+	int sizes[] = { 10, 20, 40, 60, 2048 };
+	uint8_t bin[2048], hex[4096], out_old[4096], out_new[4096];
+	int i, n;
+
+	for (i = 0; i < (int)sizeof(bin); i++)
+		bin[i] = rand();
+	old_hex_encode(hex, bin, sizeof(bin));
+	for (i = 0; i < (int)sizeof(hex); i += 3)
+		hex[i] = tolower(hex[i]);
+
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		n = sizes[i];
+
+		if ((old_hex_encode(out_old, bin, n) != new_hex_encode(out_new, bin, n)) ||
+		    memcmp(out_old, out_new, n * 2) ||
+		    (old_hex_decode_validate(out_old, hex, n * 2) != hex_decode_validate(out_new, hex, n * 2)) ||
+		    memcmp(out_old, out_new, n)) {
+			fprintf(stderr, "Hex codec output differs for %d bytes!\n", n);
+			exit(EXIT_FAILURE);
+		}
+
+		bench_codec("nibble enc", old_hex_encode, bin, n);
+		bench_codec("hex_encode", new_hex_encode, bin, n);
+		bench_codec("nibble dec", old_hex_decode_validate, hex, n * 2);
+		bench_codec("hex_decode", hex_decode_validate, hex, n * 2);
+	}
+}
+
+int main(void)
+{
+	int msglens[] = { 10, 20, 40, 60 };
+	const char types[] = { 'E', 'R' };
+	uint8_t frame[128];
+	uint8_t out_old[1024], out_new[1024];
+	int len, n_old, n_new;
+	int i, t;
+
+	srand(1);
+
+	for (t = 0; t < (int)sizeof(types); t++) {
+		for (i = 0; i < (int)(sizeof(msglens) / sizeof(msglens[0])); i++) {
+			len = make_frame(frame, types[t], msglens[i]);
+
+			n_old = old_format_out(frame, len, out_old, sizeof(out_old));
+			n_new = new_format_out(frame, len, out_new, sizeof(out_new));
+			if ((n_old != n_new) || memcmp(out_old, out_new, n_new)) {
+				fprintf(stderr, "Formatter output differs for %c frame!\n", types[t]);
+				exit(EXIT_FAILURE);
+			}
+
+			bench_format("chained", old_format_out, frame, len);
+			bench_format("table", new_format_out, frame, len);
+		}
+	}
+
+	bench_hex();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+/* CRC16 of the HM-MOD-UART framing
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC16_X86_CLMUL
+#include <immintrin.h>
+#endif
+
+#include "crc16.h"
+
+/* Below this, folding doesn't pay for its setup and the final reduction */
+#define CRC16_CLMUL_MIN	32
+
+uint16_t crc16_table[4][256];
+static pthread_once_t crc16_table_once = PTHREAD_ONCE_INIT;
+static int use_clmul = 0;
+
+#ifdef CRC16_X86_CLMUL
+/* x^128 and x^192 mod P, the fold distances for the two 64 bit halves */
+static uint64_t crc16_k128, crc16_k192;
+
+static uint64_t crc16_xpow(int n)
+{
+	uint32_t r = 1;
+
+	while (n--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x10000 | CRC16_POLY;
+	}
+
+	return r;
+}
+#endif
+
+static void crc16_init_table(void)
+{
+	uint16_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i << 8;
+		for (j = 0; j < 8; j++) {
+			if (crc & 0x8000) {
+				crc <<= 1;
+				crc ^= CRC16_POLY;
+			} else {
+				crc <<= 1;
+			}
+		}
+		crc16_table[0][i] = crc;
+	}
+
+	for (j = 1; j < 4; j++) {
+		for (i = 0; i < 256; i++) {
+			crc = crc16_table[j - 1][i];
+			crc16_table[j][i] = (crc << 8) ^ crc16_table[0][crc >> 8];
+		}
+	}
+
+#ifdef CRC16_X86_CLMUL
+	crc16_k128 = crc16_xpow(128);
+	crc16_k192 = crc16_xpow(192);
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+		use_clmul = 1;
+#endif
+}
+
+void crc16_init(void)
+{
+	pthread_once(&crc16_table_once, crc16_init_table);
+}
+
+int crc16_have_clmul(void)
+{
+	crc16_init();
+
+	return use_clmul;
+}
+
+uint16_t crc16_slice4(uint16_t crc, const uint8_t *buf, int len)
+{
+	uint16_t r;
+
+	while (len >= 4) {
+		r = crc ^ ((buf[0] << 8) | buf[1]);
+		crc = crc16_table[3][r >> 8] ^ crc16_table[2][r & 0xff] ^
+		      crc16_table[1][buf[2]] ^ crc16_table[0][buf[3]];
+		buf += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		crc = CRC16_UPDATE(crc, *buf++);
+
+	return crc;
+}
+
+#ifdef CRC16_X86_CLMUL
+/* Fold 16 bytes per step: with the input read as one big polynomial,
+ * acc * x^128 + next is congruent mod P to
+ * hi(acc) * (x^192 mod P) + lo(acc) * (x^128 mod P) + next,
+ * which fits in 128 bits again. What is left at the end is run through
+ * the tables like any other 16 bytes of message. */
+__attribute__((target("pclmul,ssse3")))
+static uint16_t crc16_fold(uint16_t crc, const uint8_t *buf, int len)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k = _mm_set_epi64x(crc16_k192, crc16_k128);
+	__m128i acc, data;
+	uint8_t rest[16];
+
+	acc = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)buf), bswap);
+	acc = _mm_xor_si128(acc, _mm_set_epi64x((uint64_t)crc << 48, 0));
+	buf += 16;
+	len -= 16;
+
+	while (len >= 16) {
+		data = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)buf), bswap);
+		data = _mm_xor_si128(data, _mm_clmulepi64_si128(acc, k, 0x11));
+		acc = _mm_xor_si128(data, _mm_clmulepi64_si128(acc, k, 0x00));
+		buf += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i*)rest, _mm_shuffle_epi8(acc, bswap));
+	crc = crc16_slice4(0, rest, sizeof(rest));
+
+	return crc16_slice4(crc, buf, len);
+}
+#endif
+
+uint16_t crc16_clmul(uint16_t crc, const uint8_t *buf, int len)
+{
+#ifdef CRC16_X86_CLMUL
+	if (use_clmul && (len >= 16))
+		return crc16_fold(crc, buf, len);
+#endif
+
+	return crc16_slice4(crc, buf, len);
+}
+
+uint16_t crc16(uint16_t crc, const uint8_t *buf, int len)
+{
+	if (len >= CRC16_CLMUL_MIN)
+		return crc16_clmul(crc, buf, len);
+
+	return crc16_slice4(crc, buf, len);
+}
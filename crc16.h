@@ -0,0 +1,37 @@
+/* CRC16 of the HM-MOD-UART framing
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define CRC16_POLY	0x8005
+#define CRC16_INIT	0xd77f
+
+/* crc16_table[n][x] is the CRC of byte x followed by n zero bytes */
+extern uint16_t crc16_table[4][256];
+
+/* Single byte step, for bytes that trickle in one at a time */
+#define CRC16_UPDATE(crc, c)	((uint16_t)(((crc) << 8) ^ crc16_table[0][(((crc) >> 8) ^ (c)) & 0xff]))
+
+void crc16_init(void);
+uint16_t crc16(uint16_t crc, const uint8_t *buf, int len);
+uint16_t crc16_slice4(uint16_t crc, const uint8_t *buf, int len);
+uint16_t crc16_clmul(uint16_t crc, const uint8_t *buf, int len);
+int crc16_have_clmul(void);
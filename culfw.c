@@ -34,35 +34,24 @@
 #include <termios.h>
 #include <unistd.h>
 
+#include "reactor.h"
+#include "serial.h"
 #include "culfw.h"
 
+#define CULFW_PROBE_TIMEOUT	1000
+
 struct culfw_dev *culfw_init(char *device, uint32_t speed, culfw_cb_fn cb, void *data)
 {
-	struct culfw_dev *dev = NULL;
-	struct termios oldtio, tio;
-	uint32_t brate;
+	struct serial_opts opts;
 
-	switch(speed) {
-		case 115200:
-			brate = B115200;
-			break;
-		case 57600:
-			brate = B57600;
-			break;
-		case 38400:
-			brate = B38400;
-			break;
-		case 19200:
-			brate = B19200;
-			break;
-		case 9600:
-			brate = B9600;
-			break;
-		default:
-			fprintf(stderr, "Unsupported baud-rate: %u\n", speed);
-			return NULL;
-			break;
-	}
+	serial_opts_init(&opts, speed);
+
+	return culfw_init_opts(device, &opts, cb, data);
+}
+
+struct culfw_dev *culfw_init_opts(char *device, struct serial_opts *opts, culfw_cb_fn cb, void *data)
+{
+	struct culfw_dev *dev = NULL;
 
 	dev = malloc(sizeof(struct culfw_dev));
 	if (dev == NULL) {
@@ -72,31 +61,18 @@ struct culfw_dev *culfw_init(char *device, uint32_t speed, culfw_cb_fn cb, void
 
 	memset(dev, 0, sizeof(struct culfw_dev));
 
-	dev->fd = open(device, O_RDWR | O_NOCTTY);
-	if (dev->fd < 0) {
-		perror("open(culfw)");
+	opts->canonical = 0;
+	dev->fd = serial_open(device, opts);
+	if (dev->fd < 0)
 		goto out;
-	}
 
-	if (tcgetattr(dev->fd, &oldtio) == -1) {
-		perror("tcgetattr");
-		goto out2;
-	}
-
-	memset(&tio, 0, sizeof(tio));
+	dev->read_chunk = opts->read_chunk;
+	if (dev->read_chunk > (CULFW_RX_BUF / 2))
+		dev->read_chunk = CULFW_RX_BUF / 2;
 
-	tio.c_cflag = brate | CS8 | CLOCAL | CREAD;
-	tio.c_iflag = IGNPAR | ICRNL;
-	tio.c_oflag = 0;
-	tio.c_lflag = ICANON;
-	tio.c_cc[VTIME] = 0;
-	tio.c_cc[VMIN] = 1;
-
-	tcflush(dev->fd, TCIFLUSH);
-	if (tcsetattr(dev->fd, TCSANOW, &tio) == -1) {
-		perror("tcsetattr");
+	dev->reactor = reactor_init();
+	if ((!dev->reactor) || (!reactor_add(dev->reactor, dev->fd, POLLIN, dev)))
 		goto out2;
-	}
 
 	dev->cb = cb;
 	dev->cb_data = data;
@@ -104,6 +80,7 @@ struct culfw_dev *culfw_init(char *device, uint32_t speed, culfw_cb_fn cb, void
 	return dev;
 
 out2:
+	reactor_close(dev->reactor);
 	close(dev->fd);
 out:
 	free(dev);
@@ -127,21 +104,79 @@ int culfw_send(struct culfw_dev *dev, char *cmd, int cmdlen)
 	return 1;
 }
 
+/* Hands the next complete line in rx to the callback, in place and
+ * without the line terminator. Only one line per call: callers keep
+ * the parsed state of a single line and check it after every poll, the
+ * rest stays buffered for the next call. */
+static int culfw_deliver(struct culfw_dev *dev)
+{
+	uint8_t *line;
+	uint8_t *nl;
+	int delivered = 0;
+	int len;
+
+	while (dev->rx_scan < dev->rx_end) {
+		nl = memchr(dev->rx + dev->rx_scan, '\n', dev->rx_end - dev->rx_scan);
+		if (!nl) {
+			dev->rx_scan = dev->rx_end;
+			break;
+		}
+
+		line = dev->rx + dev->rx_start;
+		len = nl - line;
+		dev->rx_start = dev->rx_scan = (nl - dev->rx) + 1;
+
+		if ((len > 0) && (line[len - 1] == '\r'))
+			len--;
+		line[len] = '\0';
+
+		if (len == 0)
+			continue;
+
+		dev->cb(line, len, dev->cb_data);
+		delivered = 1;
+		break;
+	}
+
+	if (dev->rx_start == dev->rx_end)
+		dev->rx_start = dev->rx_end = dev->rx_scan = 0;
+
+	return delivered;
+}
+
+/* Make room for another read() by moving the partial line to the front */
+static void culfw_compact(struct culfw_dev *dev)
+{
+	int len;
+
+	if ((CULFW_RX_BUF - dev->rx_end) >= dev->read_chunk)
+		return;
+
+	len = dev->rx_end - dev->rx_start;
+	if (len > (CULFW_RX_BUF - dev->read_chunk)) {
+		fprintf(stderr, "Discarding overlong line from CUL\n");
+		dev->rx_start = dev->rx_end = dev->rx_scan = 0;
+		return;
+	}
+
+	memmove(dev->rx, dev->rx + dev->rx_start, len);
+	dev->rx_scan -= dev->rx_start;
+	dev->rx_start = 0;
+	dev->rx_end = len;
+}
+
 int culfw_poll(struct culfw_dev *dev, int timeout)
 {
-	struct pollfd pfds[1];
+	struct reactor_event ev[1];
 	int ret;
 	int r = 0;
-	uint8_t buf[1024];
 
 	errno = 0;
 
-	memset(pfds, 0, sizeof(struct pollfd) * 1);
-
-	pfds[0].fd = dev->fd;
-	pfds[0].events = POLLIN;
+	if (culfw_deliver(dev))
+		return -1;
 
-	ret = poll(pfds, 1, timeout);
+	ret = reactor_wait(dev->reactor, ev, 1, timeout);
 	if (ret == -1)
 		return -1;
 
@@ -150,13 +185,14 @@ int culfw_poll(struct culfw_dev *dev, int timeout)
 		return -1;
 	}
 
-	if (!(pfds[0].revents & POLLIN)) {
+	if (!(ev[0].revents & POLLIN)) {
 		errno = EIO;
 		return -1;
 	}
 
-	memset(buf, 0, sizeof(buf));
-	r = read(dev->fd, buf, sizeof(buf));
+	culfw_compact(dev);
+
+	r = read(dev->fd, dev->rx + dev->rx_end, dev->read_chunk);
 	if (r < 0)
 		return -1;
 
@@ -165,7 +201,9 @@ int culfw_poll(struct culfw_dev *dev, int timeout)
 		return -1;
 	}
 
-	dev->cb(buf, r, dev->cb_data);
+	dev->rx_end += r;
+
+	culfw_deliver(dev);
 
 	errno = 0;
 	return -1;
@@ -173,6 +211,7 @@ int culfw_poll(struct culfw_dev *dev, int timeout)
 
 void culfw_close(struct culfw_dev *dev)
 {
+	reactor_close(dev->reactor);
 	close(dev->fd);
 }
 
@@ -204,5 +243,54 @@ void culfw_flush(struct culfw_dev *dev)
 			break;
 	}
 
+	dev->rx_start = dev->rx_end = dev->rx_scan = 0;
+
 	return;
 }
+
+static int culfw_probe_parse(uint8_t *buf, int buf_len, void *data)
+{
+	int *answered = data;
+
+	if ((buf_len > 0) && (buf[0] == 'V'))
+		*answered = 1;
+
+	return 1;
+}
+
+/* Round trip of count version queries, returns how many were answered */
+int culfw_probe_latency(struct culfw_dev *dev, int count, struct serial_latency *lat)
+{
+	culfw_cb_fn cb_old = dev->cb;
+	void *cb_data_old = dev->cb_data;
+	uint64_t start;
+	int answered = 0;
+	int done;
+	int i;
+
+	dev->cb = culfw_probe_parse;
+	dev->cb_data = &done;
+
+	for (i = 0; i < count; i++) {
+		done = 0;
+		start = serial_now_us();
+		if (!culfw_send(dev, "V\r\n", 3))
+			break;
+
+		do {
+			errno = 0;
+			culfw_poll(dev, CULFW_PROBE_TIMEOUT);
+		} while ((!done) && (!errno));
+
+		if (!done)
+			continue;
+
+		serial_latency_add(lat, serial_now_us() - start);
+		answered++;
+	}
+
+	dev->cb = cb_old;
+	dev->cb_data = cb_data_old;
+
+	return answered;
+}
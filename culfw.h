@@ -22,17 +22,30 @@
  */
 
 #define DEFAULT_CUL_BPS	38400
+#define CULFW_RX_BUF	2048
 
 typedef int (*culfw_cb_fn)(uint8_t *buf, int buf_len, void *data);
 
+struct reactor;
+struct serial_opts;
+struct serial_latency;
+
 struct culfw_dev {
 	int fd;
+	struct reactor *reactor;
 	culfw_cb_fn cb;
 	void *cb_data;
+	int read_chunk;		/* bytes per read() */
+	uint8_t rx[CULFW_RX_BUF];	/* raw input, lines are split in place */
+	int rx_start;		/* first byte not yet handed to cb */
+	int rx_end;		/* end of valid data in rx */
+	int rx_scan;		/* rx_start..rx_scan is known to hold no '\n' */
 };
 
 struct culfw_dev *culfw_init(char *device, uint32_t speed, culfw_cb_fn cb, void *data);
+struct culfw_dev *culfw_init_opts(char *device, struct serial_opts *opts, culfw_cb_fn cb, void *data);
 int culfw_send(struct culfw_dev *dev, char *cmd, int cmdlen);
 int culfw_poll(struct culfw_dev *dev, int timeout);
 void culfw_close(struct culfw_dev *dev);
 void culfw_flush(struct culfw_dev *dev);
+int culfw_probe_latency(struct culfw_dev *dev, int count, struct serial_latency *lat);
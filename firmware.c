@@ -25,13 +25,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <fnmatch.h>
+#include <zlib.h>
 
 #include "util.h"
 #include "firmware.h"
@@ -39,16 +43,127 @@
 /* This might be wrong, but it works for current fw */
 #define MAX_BLOCK_LENGTH	2048
 
-struct firmware* firmware_read_firmware(char *filename, int debug)
+#define FIRMWARE_READ_CHUNK	(64 * 1024)
+#define FIRMWARE_MAX_SIZE	(16 * 1024 * 1024)	/* hex source, real images are a few 100 KB */
+
+/* Precompiled image, all fields big endian like the block headers:
+ * magic, version, source hash (8 bytes), block count, data length,
+ * CRC32 of everything after the header, one data offset per block,
+ * then the blocks as in struct firmware */
+#define FIRMWARE_CACHE_MAGIC	"HMFW"
+#define FIRMWARE_CACHE_VERSION	2
+#define FIRMWARE_CACHE_HDR	28
+#define FIRMWARE_CACHE_ENV	"HMCFGUSB_FW_CACHE"
+
+#define FIRMWARE_HASH_INIT	0xcbf29ce484222325ULL
+
+/* eQ-3 update bundles are .tgz files with the image next to an info
+ * file and a changelog */
+#define FIRMWARE_TAR_BLOCK	512
+#define FIRMWARE_TGZ_PATTERN	"*.eq3"
+
+static uint32_t get_be32(uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/* FNV-1a, only used to key the cache */
+static uint64_t firmware_hash(uint64_t hash, uint8_t *image, size_t image_len)
+{
+	size_t i;
+
+	for (i = 0; i < image_len; i++) {
+		hash ^= image[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* zlib's crc32() takes at most a uInt per call */
+static uint32_t firmware_crc32(uint32_t crc, uint8_t *buf, size_t len)
+{
+	uInt n;
+
+	while (len) {
+		n = (len > FIRMWARE_READ_CHUNK) ? FIRMWARE_READ_CHUNK : len;
+		crc = crc32(crc, buf, n);
+		buf += n;
+		len -= n;
+	}
+
+	return crc;
+}
+
+/* Name of the cache entry for hash, 0 if caching is not enabled */
+static int firmware_cache_file(char *buf, int len, uint64_t hash)
+{
+	char *cache_dir;
+
+	cache_dir = getenv(FIRMWARE_CACHE_ENV);
+	if ((!cache_dir) || (!*cache_dir))
+		return 0;
+
+	snprintf(buf, len, "%s/%016" PRIx64 ".hmfw", cache_dir, hash);
+
+	return 1;
+}
+
+/* Decodes a hex image (4 hex digits block length followed by the block)
+ * into one arena holding the block pointer table and all blocks. */
+static struct firmware* firmware_parse(uint8_t *image, size_t image_len, int debug)
 {
 	struct firmware *fw;
-	struct stat stat_buf;
-	uint8_t buf[4096];
+	uint8_t hdr[2];
+	uint8_t *arena;
+	uint8_t *block;
+	size_t total = 0;
+	size_t pos;
 	uint16_t len;
-	int fd;
-	int r;
+	int blocks = 0;
 	int i;
 
+	/* First pass: block count and arena size, from the length fields only */
+	for (pos = 0; pos < image_len; pos += 4 + (len * 2)) {
+		if ((image_len - pos) < 4) {
+			printf("can't get length information!\n");
+			return NULL;
+		}
+
+		if (hex_decode_validate(hdr, image + pos, 4) != 2) {
+			fprintf(stderr, "Firmware file not valid!\n");
+			return NULL;
+		}
+
+		len = (hdr[0] << 8) | hdr[1];
+
+		if (len > MAX_BLOCK_LENGTH) {
+			fprintf(stderr, "Invalid block-length %u > %u for block %d!\n", len, MAX_BLOCK_LENGTH, blocks+1);
+			return NULL;
+		}
+
+		if ((image_len - pos - 4) < (size_t)(len * 2)) {
+			fprintf(stderr, "short read, aborting (%zu < %d)\n", image_len - pos - 4, len * 2);
+			return NULL;
+		}
+
+		total += len + 4;
+		blocks++;
+	}
+
+	if (blocks == 0) {
+		fprintf(stderr, "Firmware file not valid!\n");
+		return NULL;
+	}
+
 	fw = malloc(sizeof(struct firmware));
 	if (!fw) {
 		perror("malloc(fw)");
@@ -57,96 +172,603 @@ struct firmware* firmware_read_firmware(char *filename, int debug)
 
 	memset(fw, 0, sizeof(struct firmware));
 
-	if (stat(filename, &stat_buf) == -1) {
-		fprintf(stderr, "Can't stat %s: %s\n", filename, strerror(errno));
-		exit(EXIT_FAILURE);
+	arena = malloc((sizeof(uint8_t*) * blocks) + total);
+	if (!arena) {
+		perror("Can't allocate memory for firmware");
+		free(fw);
+		return NULL;
+	}
+
+	fw->fw = (uint8_t**)arena;
+	block = arena + (sizeof(uint8_t*) * blocks);
+
+	/* Second pass: validate and decode everything into the arena */
+	for (i = 0, pos = 0; i < blocks; i++, pos += 4 + (len * 2)) {
+		hex_decode_validate(hdr, image + pos, 4);
+		len = (hdr[0] << 8) | hdr[1];
+
+		block[0] = (i >> 8) & 0xff;
+		block[1] = i & 0xff;
+		block[2] = hdr[0];
+		block[3] = hdr[1];
+
+		if (hex_decode_validate(block + 4, image + pos + 4, len * 2) != len) {
+			fprintf(stderr, "Firmware file not valid!\n");
+			firmware_free(fw);
+			return NULL;
+		}
+
+		fw->fw[i] = block;
+		fw->fw_blocks++;
+		block += len + 4;
+
+		if (debug)
+			printf("Firmware block %d with length %u read.\n", fw->fw_blocks, len);
 	}
 
+	return fw;
+}
+
+/* Takes over image (mapped or malloc()ed) on success, nothing is decoded */
+static struct firmware* firmware_from_cache(uint8_t *image, size_t image_len, int mapped)
+{
+	struct firmware *fw;
+	uint8_t *data;
+	uint32_t data_len;
+	uint32_t off;
+	uint16_t len;
+	int blocks;
+	int i;
+
+	if ((image_len < FIRMWARE_CACHE_HDR) ||
+	    memcmp(image, FIRMWARE_CACHE_MAGIC, 4) ||
+	    (get_be32(image + 4) != FIRMWARE_CACHE_VERSION)) {
+		fprintf(stderr, "Precompiled firmware not valid!\n");
+		return NULL;
+	}
+
+	blocks = get_be32(image + 16);
+	data_len = get_be32(image + 20);
+
+	if ((blocks <= 0) || (blocks > ((int)(image_len / 4))) ||
+	    ((FIRMWARE_CACHE_HDR + ((uint64_t)blocks * 4) + data_len) != image_len)) {
+		fprintf(stderr, "Precompiled firmware not valid!\n");
+		return NULL;
+	}
+
+	if (firmware_crc32(crc32(0L, Z_NULL, 0), image + FIRMWARE_CACHE_HDR, image_len - FIRMWARE_CACHE_HDR) != get_be32(image + 24)) {
+		fprintf(stderr, "Precompiled firmware is corrupt (checksum mismatch)!\n");
+		return NULL;
+	}
+
+	data = image + FIRMWARE_CACHE_HDR + (blocks * 4);
+
+	fw = malloc(sizeof(struct firmware));
+	if (!fw) {
+		perror("malloc(fw)");
+		return NULL;
+	}
+
+	memset(fw, 0, sizeof(struct firmware));
+
+	fw->fw = malloc(sizeof(uint8_t*) * blocks);
+	if (!fw->fw) {
+		perror("Can't allocate memory for fw->fw-blocklist");
+		free(fw);
+		return NULL;
+	}
+
+	for (i = 0; i < blocks; i++) {
+		off = get_be32(image + FIRMWARE_CACHE_HDR + (i * 4));
+		if ((off > data_len) || ((data_len - off) < 4))
+			goto invalid;
+
+		len = (data[off + 2] << 8) | data[off + 3];
+		if ((len > MAX_BLOCK_LENGTH) || ((data_len - off - 4) < len) ||
+		    (((data[off] << 8) | data[off + 1]) != i))
+			goto invalid;
+
+		fw->fw[i] = data + off;
+	}
+
+	fw->fw_blocks = blocks;
+	fw->hash = ((uint64_t)get_be32(image + 8) << 32) | get_be32(image + 12);
+	fw->cache = image;
+	fw->cache_len = image_len;
+	fw->cache_mapped = mapped;
+
+	return fw;
+
+invalid:
+	fprintf(stderr, "Precompiled firmware not valid!\n");
+	free(fw->fw);
+	free(fw);
+	return NULL;
+}
+
+/* Returns NULL quietly when there is no usable cache entry for hash */
+static struct firmware* firmware_read_cache(char *filename, uint64_t hash, int debug)
+{
+	struct firmware *fw;
+	struct stat stat_buf;
+	uint8_t *image;
+	int fd;
+
 	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "Can't open %s: %s", filename, strerror(errno));
-		exit(EXIT_FAILURE);
+	if (fd < 0)
+		return NULL;
+
+	if ((fstat(fd, &stat_buf) == -1) || (stat_buf.st_size < FIRMWARE_CACHE_HDR)) {
+		close(fd);
+		return NULL;
 	}
 
-	printf("Reading firmware from %s...\n", filename);
-	do {
-		memset(buf, 0, sizeof(buf));
-		r = read(fd, buf, 4);
-		if (r < 0) {
-			perror("read");
-			exit(EXIT_FAILURE);
-		} else if (r == 0) {
-			break;
-		} else if (r != 4) {
+	/* Private and writable like a decoded image, changes stay local */
+	image = mmap(NULL, stat_buf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
+
+	fw = firmware_from_cache(image, stat_buf.st_size, 1);
+	if (!fw) {
+		munmap(image, stat_buf.st_size);
+		return NULL;
+	}
+
+	if (fw->hash != hash) {
+		firmware_free(fw);
+		return NULL;
+	}
+
+	if (debug)
+		printf("Using precompiled firmware %s\n", filename);
+
+	return fw;
+}
+
+/* Written to a temporary file first, so concurrent runs never see a
+ * partial cache entry */
+int firmware_write_cache(struct firmware *fw, char *filename)
+{
+	uint8_t hdr[FIRMWARE_CACHE_HDR];
+	uint8_t off[4];
+	char tmpname[1024];
+	uint32_t data_len = 0;
+	uint32_t crc;
+	uint16_t len;
+	FILE *f;
+	int err;
+	int i;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, getpid());
+
+	f = fopen(tmpname, "w");
+	if (!f) {
+		fprintf(stderr, "Can't open %s: %s\n", tmpname, strerror(errno));
+		return 0;
+	}
+
+	/* Offsets and blocks are checksummed before anything is written */
+	crc = crc32(0L, Z_NULL, 0);
+	for (i = 0; i < fw->fw_blocks; i++) {
+		put_be32(off, data_len);
+		crc = crc32(crc, off, sizeof(off));
+		data_len += ((fw->fw[i][2] << 8) | fw->fw[i][3]) + 4;
+	}
+	for (i = 0; i < fw->fw_blocks; i++) {
+		len = (fw->fw[i][2] << 8) | fw->fw[i][3];
+		crc = crc32(crc, fw->fw[i], len + 4);
+	}
+
+	memcpy(hdr, FIRMWARE_CACHE_MAGIC, 4);
+	put_be32(hdr + 4, FIRMWARE_CACHE_VERSION);
+	put_be32(hdr + 8, fw->hash >> 32);
+	put_be32(hdr + 12, fw->hash & 0xffffffff);
+	put_be32(hdr + 16, fw->fw_blocks);
+	put_be32(hdr + 20, data_len);
+	put_be32(hdr + 24, crc);
+	fwrite(hdr, sizeof(hdr), 1, f);
+
+	data_len = 0;
+	for (i = 0; i < fw->fw_blocks; i++) {
+		put_be32(off, data_len);
+		fwrite(off, sizeof(off), 1, f);
+		data_len += ((fw->fw[i][2] << 8) | fw->fw[i][3]) + 4;
+	}
+
+	for (i = 0; i < fw->fw_blocks; i++) {
+		len = (fw->fw[i][2] << 8) | fw->fw[i][3];
+		fwrite(fw->fw[i], len + 4, 1, f);
+	}
+
+	err = ferror(f);
+	if (fclose(f) || err) {
+		fprintf(stderr, "Can't write %s: %s\n", tmpname, strerror(errno));
+		unlink(tmpname);
+		return 0;
+	}
+
+	if (rename(tmpname, filename) == -1) {
+		fprintf(stderr, "Can't rename %s to %s: %s\n", tmpname, filename, strerror(errno));
+		unlink(tmpname);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int firmware_is_gzip(int fd)
+{
+	uint8_t magic[2];
+
+	return ((pread(fd, magic, sizeof(magic), 0) == sizeof(magic)) &&
+		(magic[0] == 0x1f) && (magic[1] == 0x8b));
+}
+
+/* Decodes a tar member of size bytes block by block straight from the
+ * inflate stream. Memory is bounded by the member size: the decoded
+ * image is never larger than its hex source. */
+static struct firmware* firmware_parse_stream(gzFile gz, size_t size, int debug)
+{
+	struct firmware *fw;
+	uint8_t buf[MAX_BLOCK_LENGTH * 2];
+	uint8_t *data;
+	uint8_t *arena;
+	uint64_t hash = FIRMWARE_HASH_INIT;
+	size_t used = 0;
+	size_t pos = 0;
+	size_t ptrs;
+	uint16_t len;
+	int blocks = 0;
+	int i;
+
+	if (size > FIRMWARE_MAX_SIZE) {
+		fprintf(stderr, "Firmware in archive too large (%zu bytes)!\n", size);
+		return NULL;
+	}
+
+	data = malloc(size ? size : 1);
+	if (!data) {
+		perror("Can't allocate memory for firmware");
+		return NULL;
+	}
+
+	while (pos < size) {
+		if ((size - pos) < 4) {
 			printf("can't get length information!\n");
-			exit(EXIT_FAILURE);
+			goto out;
 		}
 
-		for (i = 0; i < r; i++) {
-			if (!validate_nibble(buf[i])) {
-				fprintf(stderr, "Firmware file not valid!\n");
-				exit(EXIT_FAILURE);
-			}
+		if (gzread(gz, buf, 4) != 4) {
+			fprintf(stderr, "short read, aborting\n");
+			goto out;
 		}
+		hash = firmware_hash(hash, buf, 4);
 
-		len = (ascii_to_nibble(buf[0]) & 0xf)<< 4;
-		len |= ascii_to_nibble(buf[1]) & 0xf;
-		len <<= 8;
-		len |= (ascii_to_nibble(buf[2]) & 0xf)<< 4;
-		len |= ascii_to_nibble(buf[3]) & 0xf;
+		if (hex_decode_validate(buf, buf, 4) != 2) {
+			fprintf(stderr, "Firmware file not valid!\n");
+			goto out;
+		}
+
+		len = (buf[0] << 8) | buf[1];
 
 		if (len > MAX_BLOCK_LENGTH) {
-			fprintf(stderr, "Invalid block-length %u > %u for block %d!\n", len, MAX_BLOCK_LENGTH, fw->fw_blocks+1);
-			exit(EXIT_FAILURE);
+			fprintf(stderr, "Invalid block-length %u > %u for block %d!\n", len, MAX_BLOCK_LENGTH, blocks+1);
+			goto out;
 		}
 
-		fw->fw = realloc(fw->fw, sizeof(uint8_t*) * (fw->fw_blocks + 1));
-		if (fw->fw == NULL) {
-			perror("Can't reallocate fw->fw-blocklist");
-			exit(EXIT_FAILURE);
+		if (((size - pos - 4) < (size_t)(len * 2)) ||
+		    (gzread(gz, buf + 4, len * 2) != (len * 2))) {
+			fprintf(stderr, "short read, aborting\n");
+			goto out;
 		}
+		hash = firmware_hash(hash, buf + 4, len * 2);
 
-		fw->fw[fw->fw_blocks] = malloc(len + 4);
-		if (fw->fw[fw->fw_blocks] == NULL) {
-			perror("Can't allocate memory for fw->fw-block");
-			exit(EXIT_FAILURE);
+		data[used] = (blocks >> 8) & 0xff;
+		data[used + 1] = blocks & 0xff;
+		data[used + 2] = buf[0];
+		data[used + 3] = buf[1];
+
+		if (hex_decode_validate(data + used + 4, buf + 4, len * 2) != len) {
+			fprintf(stderr, "Firmware file not valid!\n");
+			goto out;
+		}
+
+		blocks++;
+		used += len + 4;
+		pos += 4 + (len * 2);
+
+		if (debug)
+			printf("Firmware block %d with length %u read.\n", blocks, len);
+	}
+
+	if (blocks == 0) {
+		fprintf(stderr, "Firmware file not valid!\n");
+		goto out;
+	}
+
+	/* Same layout as firmware_parse(): pointer table, then the blocks */
+	ptrs = sizeof(uint8_t*) * blocks;
+	arena = realloc(data, ptrs + used);
+	if (!arena) {
+		perror("Can't allocate memory for firmware");
+		goto out;
+	}
+	data = arena;
+	memmove(arena + ptrs, arena, used);
+
+	fw = malloc(sizeof(struct firmware));
+	if (!fw) {
+		perror("malloc(fw)");
+		goto out;
+	}
+
+	memset(fw, 0, sizeof(struct firmware));
+
+	fw->fw = (uint8_t**)arena;
+	for (i = 0, pos = ptrs; i < blocks; i++) {
+		fw->fw[i] = arena + pos;
+		pos += ((arena[pos + 2] << 8) | arena[pos + 3]) + 4;
+	}
+	fw->fw_blocks = blocks;
+	fw->hash = hash;
+
+	return fw;
+
+out:
+	free(data);
+	return NULL;
+}
+
+/* Walks the tar headers in the inflate stream and decodes the first
+ * regular member whose name (or basename, if pattern has no '/')
+ * matches pattern. Other members are skipped without buffering. */
+static struct firmware* firmware_read_tgz(int fd, char *pattern, int debug)
+{
+	struct firmware *fw = NULL;
+	uint8_t hdr[FIRMWARE_TAR_BLOCK];
+	char name[256];
+	char *base;
+	size_t size;
+	gzFile gz;
+	int i;
+
+	gz = gzdopen(fd, "rb");
+	if (!gz) {
+		perror("gzdopen");
+		close(fd);
+		return NULL;
+	}
+
+	while (1) {
+		if ((gzread(gz, hdr, sizeof(hdr)) != sizeof(hdr)) || (!hdr[0])) {
+			fprintf(stderr, "No firmware matching %s found in archive\n", pattern);
+			break;
 		}
 
-		fw->fw[fw->fw_blocks][0] = (fw->fw_blocks >> 8) & 0xff;
-		fw->fw[fw->fw_blocks][1] = fw->fw_blocks & 0xff;
-		fw->fw[fw->fw_blocks][2] = (len >> 8) & 0xff;
-		fw->fw[fw->fw_blocks][3] = len & 0xff;
+		/* ustar splits long names into prefix and name */
+		name[0] = '\0';
+		if ((!memcmp(hdr + 257, "ustar", 5)) && hdr[345])
+			snprintf(name, sizeof(name), "%.155s/", (char*)hdr + 345);
+		snprintf(name + strlen(name), sizeof(name) - strlen(name), "%.100s", (char*)hdr);
+
+		size = 0;
+		for (i = 124; (i < 136) && (hdr[i] >= '0') && (hdr[i] <= '7'); i++)
+			size = (size << 3) | (hdr[i] - '0');
+
+		base = strrchr(name, '/');
+		base = (base && !strchr(pattern, '/')) ? base + 1 : name;
 
-		r = read(fd, buf, len * 2);
+		if (((hdr[156] == '0') || (hdr[156] == '\0')) &&
+		    (!fnmatch(pattern, base, 0))) {
+			printf("Using %s from archive\n", name);
+			fw = firmware_parse_stream(gz, size, debug);
+			break;
+		}
+
+		size = (size + FIRMWARE_TAR_BLOCK - 1) & ~((size_t)FIRMWARE_TAR_BLOCK - 1);
+		if (gzseek(gz, size, SEEK_CUR) < 0) {
+			fprintf(stderr, "Can't skip %s in archive\n", name);
+			break;
+		}
+	}
+
+	gzclose(gz);
+
+	return fw;
+}
+
+/* Cache key of a bundle: the archive itself plus the member pattern, so
+ * a cache hit doesn't inflate anything. 0 if fd is not a regular file. */
+static int firmware_archive_hash(int fd, char *pattern, uint64_t *hash)
+{
+	struct stat stat_buf;
+	uint8_t *archive;
+
+	if ((fstat(fd, &stat_buf) == -1) || (!S_ISREG(stat_buf.st_mode)) || (stat_buf.st_size <= 0))
+		return 0;
+
+	archive = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (archive == MAP_FAILED)
+		return 0;
+
+	*hash = firmware_hash(FIRMWARE_HASH_INIT, archive, stat_buf.st_size);
+	*hash = firmware_hash(*hash, (uint8_t*)pattern, strlen(pattern));
+
+	munmap(archive, stat_buf.st_size);
+
+	return 1;
+}
+
+/* Reads a pipe or other stream completely, coping with short reads */
+static uint8_t* firmware_slurp(int fd, size_t *image_len)
+{
+	uint8_t *image = NULL;
+	uint8_t *tmp;
+	size_t size = 0;
+	size_t used = 0;
+	ssize_t r;
+
+	while (1) {
+		if ((size - used) < FIRMWARE_READ_CHUNK) {
+			size = size ? (size * 2) : (FIRMWARE_READ_CHUNK * 2);
+			tmp = realloc(image, size);
+			if (!tmp) {
+				perror("Can't allocate memory for firmware image");
+				free(image);
+				return NULL;
+			}
+			image = tmp;
+		}
+
+		r = read(fd, image + used, size - used);
 		if (r < 0) {
+			if (errno == EINTR)
+				continue;
 			perror("read");
-			exit(EXIT_FAILURE);
-		} else if (r < len * 2) {
-			fprintf(stderr, "short read, aborting (%d < %d)\n", r, len * 2);
+			free(image);
+			return NULL;
+		} else if (r == 0) {
+			break;
+		}
+
+		used += r;
+	}
+
+	*image_len = used;
+	return image;
+}
+
+/* Regular files are mapped, everything else (including "-" for stdin)
+ * is read through firmware_slurp(). With HMCFGUSB_FW_CACHE set, decoded
+ * images are looked up in and stored to that directory by source hash. */
+struct firmware* firmware_read_firmware(char *filename, int debug)
+{
+	struct firmware *fw = NULL;
+	struct stat stat_buf;
+	char cache_file[1024];
+	char archive[1024];
+	char *member = NULL;
+	char *pattern;
+	char *sep;
+	uint64_t hash = 0;
+	uint8_t *image = NULL;
+	size_t image_len = 0;
+	int mapped = 0;
+	int cached;
+	int fd;
+
+	if (!strcmp(filename, "-")) {
+		fd = STDIN_FILENO;
+	} else {
+		fd = open(filename, O_RDONLY);
+
+		/* bundle.tgz:pattern selects a member of an update bundle */
+		if ((fd < 0) && (errno == ENOENT) && (sep = strrchr(filename, ':')) &&
+		    ((sep - filename) < (int)sizeof(archive))) {
+			memcpy(archive, filename, sep - filename);
+			archive[sep - filename] = '\0';
+			member = sep + 1;
+			fd = open(archive, O_RDONLY);
+		}
+
+		if (fd < 0) {
+			fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
 			exit(EXIT_FAILURE);
 		}
+	}
+
+	if (firmware_is_gzip(fd)) {
+		pattern = member ? member : FIRMWARE_TGZ_PATTERN;
+		printf("Reading firmware from %s...\n", filename);
+
+		cached = firmware_archive_hash(fd, pattern, &hash) &&
+			 firmware_cache_file(cache_file, sizeof(cache_file), hash);
+		if (cached)
+			fw = firmware_read_cache(cache_file, hash, debug);
 
-		for (i = 0; i < r; i+=2) {
-			if ((!validate_nibble(buf[i])) ||
-			    (!validate_nibble(buf[i+1]))) {
-				fprintf(stderr, "Firmware file not valid!\n");
+		if (fw) {
+			if (fd != STDIN_FILENO)
+				close(fd);
+		} else {
+			fw = firmware_read_tgz(fd, pattern, debug);
+			if (!fw)
 				exit(EXIT_FAILURE);
+
+			if (cached) {
+				fw->hash = hash;
+				if (firmware_write_cache(fw, cache_file) && debug)
+					printf("Precompiled firmware written to %s\n", cache_file);
 			}
+		}
+
+		printf("Firmware with %d blocks successfully read.\n", fw->fw_blocks);
+		return fw;
+	} else if (member) {
+		fprintf(stderr, "%s is not a .tgz archive\n", archive);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(fd, &stat_buf) == -1) {
+		fprintf(stderr, "Can't stat %s: %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Reading firmware from %s...\n", filename);
 
-			fw->fw[fw->fw_blocks][(i/2) + 4] = (ascii_to_nibble(buf[i]) & 0xf)<< 4;
-			fw->fw[fw->fw_blocks][(i/2) + 4] |= ascii_to_nibble(buf[i+1]) & 0xf;
+	if (S_ISREG(stat_buf.st_mode) && (stat_buf.st_size > 0)) {
+		image_len = stat_buf.st_size;
+		image = mmap(NULL, image_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (image == MAP_FAILED) {
+			image = NULL;
+		} else {
+			madvise(image, image_len, MADV_SEQUENTIAL);
+			mapped = 1;
 		}
+	}
 
-		fw->fw_blocks++;
-		if (debug)
-			printf("Firmware block %d with length %u read.\n", fw->fw_blocks, len);
-	} while(r > 0);
+	if (!image)
+		image = firmware_slurp(fd, &image_len);
 
-	if (fw->fw_blocks == 0) {
-		fprintf(stderr, "Firmware file not valid!\n");
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	if (!image)
 		exit(EXIT_FAILURE);
+
+	/* Precompiled image given directly */
+	if ((image_len >= 4) && (!memcmp(image, FIRMWARE_CACHE_MAGIC, 4))) {
+		fw = firmware_from_cache(image, image_len, mapped);
+		if (!fw)
+			exit(EXIT_FAILURE);
+
+		printf("Precompiled firmware with %d blocks successfully read.\n", fw->fw_blocks);
+		return fw;
 	}
 
+	hash = firmware_hash(FIRMWARE_HASH_INIT, image, image_len);
+
+	cached = firmware_cache_file(cache_file, sizeof(cache_file), hash);
+	if (cached)
+		fw = firmware_read_cache(cache_file, hash, debug);
+
+	if (!fw) {
+		fw = firmware_parse(image, image_len, debug);
+		if (fw) {
+			fw->hash = hash;
+			if (cached && firmware_write_cache(fw, cache_file) && debug)
+				printf("Precompiled firmware written to %s\n", cache_file);
+		}
+	}
+
+	if (mapped)
+		munmap(image, image_len);
+	else
+		free(image);
+
+	if (!fw)
+		exit(EXIT_FAILURE);
+
 	printf("Firmware with %d blocks successfully read.\n", fw->fw_blocks);
 
 	return fw;
@@ -154,11 +776,12 @@ struct firmware* firmware_read_firmware(char *filename, int debug)
 
 void firmware_free(struct firmware *fw)
 {
-	int i;
+	free(fw->fw);
 
-	for (i = 0; i < fw->fw_blocks; i++)
-		free(fw->fw[i]);
+	if (fw->cache_mapped)
+		munmap(fw->cache, fw->cache_len);
+	else
+		free(fw->cache);
 
-	free(fw->fw);
 	free(fw);
 }
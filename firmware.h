@@ -21,10 +21,17 @@
  * IN THE SOFTWARE.
  */
 
+/* Decoded images keep fw and all blocks in a single allocation,
+ * precompiled images point fw into the cache file they came from */
 struct firmware {
 	uint8_t **fw;
 	int fw_blocks;
+	uint64_t hash;		/* of the source image, or archive and member pattern */
+	uint8_t *cache;		/* backing store of a precompiled image */
+	size_t cache_len;
+	int cache_mapped;
 };
 
 struct firmware* firmware_read_firmware(char *filename, int debug);
+int firmware_write_cache(struct firmware *fw, char *filename);
 void firmware_free(struct firmware *fw);
@@ -199,7 +199,6 @@ int main(int argc, char **argv)
 	firmware_free(fw);
 
 	hmcfgusb_close(dev);
-	hmcfgusb_exit();
 
 	return EXIT_SUCCESS;
 }
@@ -38,6 +38,7 @@
 #include "hexdump.h"
 #include "firmware.h"
 #include "version.h"
+#include "serial.h"
 #include "hmuartlgw.h"
 
 struct recv_data {
@@ -70,7 +71,7 @@ int main(int argc, char **argv)
 {
 	const char twiddlie[] = { '-', '\\', '|', '/' };
 	struct hmuartlgw_dev *dev;
-	uint8_t *framedata;
+	uint8_t framedata[4096];
 	struct recv_data rdata;
 	uint16_t len;
 	struct firmware *fw;
@@ -149,8 +150,14 @@ int main(int argc, char **argv)
 
 		len -= 1; /* + frametype, - crc crc */
 
-		framedata = (fw->fw[block]) + 3;
+		if (len > sizeof(framedata)) {
+			fprintf(stderr, "\n\nBlock %d too large: %u\n", block, len);
+			exit(EXIT_FAILURE);
+		}
+
+		/* Frame type replaces the low length byte, fw stays untouched */
 		framedata[0] = HMUARTLGW_OS_UPDATE_FIRMWARE;
+		memcpy(framedata + 1, fw->fw[block] + 4, len - 1);
 
 		if (debug)
 			hexdump(framedata, len, "F> ");
@@ -41,13 +41,21 @@
 #include "hm.h"
 #include "version.h"
 #include "hmcfgusb.h"
+#include "serial.h"
 #include "culfw.h"
 #include "hmuartlgw.h"
 #include "util.h"
 
-#define MAX_RETRIES		5
+#define MAX_RETRIES		5	/* block restarts */
+#define MAX_FRAME_RETRIES	5	/* resends of a single frame */
 #define NORMAL_MAX_PAYLOAD	37
 #define LOWER_MAX_PAYLOAD	17
+#define ADAPT_STEP		4	/* payload growth per good block */
+#define ADAPT_HOLD_BLOCKS	8	/* blocks to stay put after growing didn't pay off */
+#define TSCUL_SEND_TIMEOUT	5000	/* ms until a send is considered failed */
+#define UARTLGW_REQ_TIMEOUT	2000	/* ms until a command is re-sent */
+#define UARTLGW_BUSY_DELAY	50	/* ms, doubled on every EINPROGRESS */
+#define UARTLGW_BUSY_DELAY_MAX	800
 
 extern char *optarg;
 
@@ -131,13 +139,12 @@ static int parse_hmcfgusb(uint8_t *buf, int buf_len, void *data)
 static int parse_culfw(uint8_t *buf, int buf_len, void *data)
 {
 	struct recv_data *rdata = data;
-	int pos = 0;
 	int rpos = 0; // read index
 
 	memset(rdata->message, 0, sizeof(rdata->message));
 	rdata->message_type = 0;
 
-	if (buf_len <= 3)
+	if (buf_len < 3)
 		return 0;
 
 	switch(buf[0]) {
@@ -155,7 +162,7 @@ static int parse_culfw(uint8_t *buf, int buf_len, void *data)
 
 			if (buf[1] == 'F') { // tsculfw: timestamp message?
 				rdata->is_TSCUL = 1;
-				if (buf_len <= (3+14)) // tsculfw: reasonable len?
+				if (buf_len < (3+14)) // tsculfw: reasonable len?
 					return 0;
 				if (!validate_nibble(buf[3]) || !validate_nibble(buf[4])) // tsculfw: hex?
 					return 0;
@@ -192,13 +199,12 @@ static int parse_culfw(uint8_t *buf, int buf_len, void *data)
 				}
 			}
 
-			while(validate_nibble(buf[(rpos * 2) + 1]) &&
-			      validate_nibble(buf[(rpos * 2) + 2]) &&
-			      (rpos + 1 < buf_len)) {
-				rdata->message[pos] = ascii_to_nibble(buf[(rpos * 2) + 1]) << 4;
-				rdata->message[pos] |= ascii_to_nibble(buf[(rpos * 2) + 2]);
-				pos++;
-				rpos++;
+			if ((rpos * 2) + 1 < buf_len) {
+				int hexlen = buf_len - (rpos * 2) - 1;
+
+				if (hexlen > (int)(sizeof(rdata->message) * 2))
+					hexlen = sizeof(rdata->message) * 2;
+				hex_decode_validate(rdata->message, buf + (rpos * 2) + 1, hexlen);
 			}
 
 			if (hmid && (SRC(rdata->message) != hmid))
@@ -221,7 +227,7 @@ static int parse_culfw(uint8_t *buf, int buf_len, void *data)
 				s = ((char*)buf) + 2;
 				e = strchr(s, '.');
 				if (!e) {
-					fprintf(stderr, "Unknown response from CUL: %s", buf);
+					fprintf(stderr, "Unknown response from CUL: %s\n", buf);
 					return 0;
 				}
 				*e = '\0';
@@ -231,7 +237,7 @@ static int parse_culfw(uint8_t *buf, int buf_len, void *data)
 				s = e + 1;
 				e = strchr(s, ' ');
 				if (!e) {
-					fprintf(stderr, "Unknown response from CUL: %s", buf);
+					fprintf(stderr, "Unknown response from CUL: %s\n", buf);
 					return 0;
 				}
 				*e = '\0';
@@ -257,7 +263,7 @@ static int parse_culfw(uint8_t *buf, int buf_len, void *data)
 				break;
 			}
 		default:
-			fprintf(stderr, "Unknown response from CUL: %s", buf);
+			fprintf(stderr, "Unknown response from CUL: %s\n", buf);
 			return 0;
 			break;
 	}
@@ -323,26 +329,73 @@ static int parse_hmuartlgw(enum hmuartlgw_dst dst, uint8_t *buf, int buf_len, vo
 	return 1;
 }
 
+struct uartlgw_wait {
+	struct recv_data *rdata;
+	int done;
+	int timed_out;
+	uint8_t status;
+};
+
+static void send_wait_hmuartlgw_done(struct hmuartlgw_dev *dev, enum hmuartlgw_dst dst, uint8_t *buf, int buf_len, void *data)
+{
+	struct uartlgw_wait *wait = data;
+
+	wait->done = 1;
+
+	if (!buf) {
+		wait->timed_out = 1;
+		return;
+	}
+
+	wait->status = (buf_len > 1) ? buf[1] : 0;
+	parse_hmuartlgw(dst, buf, buf_len, wait->rdata);
+}
+
 int send_wait_hmuartlgw(struct hm_dev *dev, struct recv_data *rdata, uint8_t *data, int data_len,
-                        enum hmuartlgw_dst dst, enum hmuartlgw_state srcstate,
-			enum hmuartlgw_state dststate)
+                        enum hmuartlgw_dst dst, enum hmuartlgw_state srcstate)
 {
+	struct uartlgw_wait wait;
+	int delay = UARTLGW_BUSY_DELAY;
 	int cnt = 5;
 
 	do {
+		memset(&wait, 0, sizeof(wait));
+		wait.rdata = rdata;
+
 		rdata->uartlgw_state = srcstate;
-		hmuartlgw_send(dev->hmuartlgw, data, data_len, dst);
-		do { hmuartlgw_poll(dev->hmuartlgw, 500); } while (rdata->uartlgw_state != dststate);
-		if (rdata->status != HMUARTLGW_ACK_EINPROGRESS)
-			break;
-		usleep(200*1000);
+		if (hmuartlgw_send_req(dev->hmuartlgw, data, data_len, dst,
+		                       UARTLGW_REQ_TIMEOUT, send_wait_hmuartlgw_done, &wait) < 0)
+			return 0;
+
+		while (!wait.done) {
+			errno = 0;
+			hmuartlgw_poll(dev->hmuartlgw, UARTLGW_REQ_TIMEOUT);
+			if (errno && (errno != ETIMEDOUT)) {
+				perror("\n\nhmuartlgw_poll");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (wait.timed_out) {
+			fprintf(stderr, "No answer from HM-MOD-UART, re-sending command\n");
+			continue;
+		}
+
+		if (wait.status != HMUARTLGW_ACK_EINPROGRESS)
+			return 1;
+
+		usleep(delay * 1000);
+		if (delay < UARTLGW_BUSY_DELAY_MAX)
+			delay *= 2;
 	} while (cnt--);
-	if (rdata->status == HMUARTLGW_ACK_EINPROGRESS) {
+
+	if (wait.timed_out) {
+		fprintf(stderr, "HM-MOD-UART doesn't answer, giving up!\n");
+	} else {
 		fprintf(stderr, "IO thinks it is busy, you might have to reset it!\n");
-		return 0;
 	}
 
-	return 1;
+	return 0;
 }
 
 int send_hm_message(struct hm_dev *dev, struct recv_data *rdata, uint8_t *msg)
@@ -414,22 +467,21 @@ int send_hm_message(struct hm_dev *dev, struct recv_data *rdata, uint8_t *msg)
 				memset(buf, 0, sizeof(buf));
 				buf[0] = 'A';
 				buf[1] = 's';
-				for (i = 0; i < msg[0] + 1; i++) {
-					buf[2 + (i * 2)] = nibble_to_ascii((msg[i] >> 4) & 0xf);
-					buf[2 + (i * 2) + 1] = nibble_to_ascii(msg[i] & 0xf);
-				}
-				buf[2 + (i * 2) ] = '\r';
-				buf[2 + (i * 2) + 1] = '\n';
+				i = 2 + hex_encode(buf + 2, msg, msg[0] + 1);
+				buf[i] = '\r';
+				buf[i + 1] = '\n';
 
 				memset(rdata->message, 0, sizeof(rdata->message));
 				rdata->message_type = 0;
-				if (culfw_send(dev->culfw, buf, 2 + (i * 2) + 1) == 0) {
+				if (culfw_send(dev->culfw, buf, i + 1) == 0) {
 					fprintf(stderr, "culfw_send failed!\n");
 					exit(EXIT_FAILURE);
 				}
 
 				/* Wait for TSCUL to ACK send */
 				if (rdata->is_TSCUL) {
+					uint64_t deadline = serial_now_us() + (TSCUL_SEND_TIMEOUT * 1000);
+
 					do {
 						errno = 0;
 						pfd = culfw_poll(dev->culfw, 200);
@@ -439,6 +491,10 @@ int send_hm_message(struct hm_dev *dev, struct recv_data *rdata, uint8_t *msg)
 								exit(EXIT_FAILURE);
 							}
 						}
+						if (serial_now_us() > deadline) {
+							fprintf(stderr, "\ntsculfw didn't confirm send!\n");
+							return 0;
+						}
 					} while (rdata->message_type != MESSAGE_TYPE_B);
 				}
 
@@ -614,6 +670,46 @@ static int switch_speed(struct hm_dev *dev, struct recv_data *rdata, uint8_t spe
 	return 1;
 }
 
+/* State for choosing the payload length per block with -a */
+struct payload_adapt {
+	int payloadlen;
+	int prev_payloadlen;
+	uint32_t prev_rate;	/* bytes/s of the previous block */
+	int hold;
+};
+
+/* Shrinks the payload towards LOWER_MAX_PAYLOAD after a block with
+ * failures. Otherwise grows it towards max_payloadlen, unless the last
+ * increase made the block slower per byte (longer round trips), in which
+ * case the previous size is kept for a while. */
+static void adapt_payloadlen(struct payload_adapt *a, int failures, int len, uint64_t us)
+{
+	uint32_t rate = us ? ((uint64_t)len * 1000000) / us : 0;
+	int next = a->payloadlen;
+
+	if (failures) {
+		next = LOWER_MAX_PAYLOAD + ((a->payloadlen - LOWER_MAX_PAYLOAD) / 2);
+		a->hold = 0;
+	} else if (a->prev_rate && (a->payloadlen > a->prev_payloadlen) &&
+		   (((uint64_t)rate * 10) < ((uint64_t)a->prev_rate * 9))) {
+		next = a->prev_payloadlen;
+		a->hold = ADAPT_HOLD_BLOCKS;
+	} else if (a->hold) {
+		a->hold--;
+	} else {
+		next = a->payloadlen + ADAPT_STEP;
+	}
+
+	if (next > (int)max_payloadlen)
+		next = max_payloadlen;
+	if (next < LOWER_MAX_PAYLOAD)
+		next = LOWER_MAX_PAYLOAD;
+
+	a->prev_payloadlen = a->payloadlen;
+	a->prev_rate = rate;
+	a->payloadlen = next;
+}
+
 void flash_ota_syntax(char *prog)
 {
 	fprintf(stderr, "Syntax: %s parameters options\n\n", prog);
@@ -622,10 +718,15 @@ void flash_ota_syntax(char *prog)
 	fprintf(stderr, "\t-s SERIAL\tserial of device to flash (optional when using -D)\n");
 	fprintf(stderr, "\nOptional parameters:\n");
 	fprintf(stderr, "\t-c device\tenable CUL-mode with CUL at path \"device\"\n");
-	fprintf(stderr, "\t-b bps\t\tuse CUL with speed \"bps\" (default: %u)\n", DEFAULT_CUL_BPS);
+	fprintf(stderr, "\t-b bps\t\tuse CUL or HM-MOD-UART with speed \"bps\" (default: %u, HM-MOD-UART: %d)\n", DEFAULT_CUL_BPS, HMUARTLGW_SPEED);
+	serial_opts_syntax();
+	fprintf(stderr, "\t-P count\tmeasure the round trip of \"count\" queries after opening\n");
 	fprintf(stderr, "\t-l\t\tlower payloadlen (required for devices with little RAM, e.g. CUL v2 and CUL v4)\n");
+	fprintf(stderr, "\t-a\t\tadapt payloadlen per block to link quality (between %d and the maximum)\n", LOWER_MAX_PAYLOAD);
 	fprintf(stderr, "\t-S serial\tuse HM-CFG-USB with given serial\n");
 	fprintf(stderr, "\t-U device\tuse HM-MOD-UART on given device\n");
+	fprintf(stderr, "\t-L host[:port]\tuse HM-LGW-O-TW-W-EU at given address\n");
+	fprintf(stderr, "\t-w file\t\tonly write precompiled firmware to \"file\" and exit\n");
 	fprintf(stderr, "\t-h\t\tthis help\n");
 	fprintf(stderr, "\nOptional parameters for automatically sending device to bootloader\n");
 	fprintf(stderr, "\t-C\t\tHMID of central (3 hex-bytes, no prefix, e.g. ABCDEF)\n");
@@ -641,7 +742,8 @@ int main(int argc, char **argv)
 	char *serial = NULL;
 	char *culfw_dev = NULL;
 	char *endptr = NULL;
-	unsigned int bps = DEFAULT_CUL_BPS;
+	unsigned int bps = 0;
+	struct serial_opts sopts;
 	struct hm_dev dev;
 	struct recv_data rdata;
 	uint8_t out[0x40];
@@ -651,6 +753,8 @@ int main(int argc, char **argv)
 	struct firmware *fw;
 	char *hmcfgusb_serial = NULL;
 	char *uart = NULL;
+	char *lgw = NULL;
+	char *fw_cache = NULL;
 	int block;
 	int pfd;
 	int debug = 0;
@@ -658,12 +762,26 @@ int main(int argc, char **argv)
 	int switchcnt = 0;
 	int msgnum = 0;
 	int switched = 0;
+	int frame_retries = 0;
+	int block_restarts = 0;
+	int frames_saved = 0;
+	int adaptive = 0;
+	int probes = 0;
+	struct payload_adapt adapt;
+	uint64_t flash_start;
+	uint64_t flash_us;
+	uint32_t flash_bytes = 0;
 	int opt;
 
 	printf("HomeMatic OTA flasher version " VERSION "\n\n");
 
-	while((opt = getopt(argc, argv, "b:c:f:hls:C:D:K:S:U:")) != -1) {
+	serial_opts_init(&sopts, 0);
+
+	while((opt = getopt(argc, argv, "ab:c:f:hls:w:C:D:K:L:P:S:U:" SERIAL_GETOPT)) != -1) {
 		switch (opt) {
+			case 'a':
+				adaptive = 1;
+				break;
 			case 'b':
 				bps = atoi(optarg);
 				break;
@@ -673,6 +791,16 @@ int main(int argc, char **argv)
 			case 'f':
 				fw_file = optarg;
 				break;
+			case 'm':
+			case 'n':
+			case 'r':
+			case 't':
+				if (!serial_opts_getopt(&sopts, opt, optarg)) {
+					fprintf(stderr, "Invalid value for -%c!\n\n", opt);
+					flash_ota_syntax(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'l':
 				printf("Reducing payload-len from %d to %d\n", max_payloadlen, LOWER_MAX_PAYLOAD);
 				max_payloadlen = LOWER_MAX_PAYLOAD;
@@ -680,6 +808,9 @@ int main(int argc, char **argv)
 			case 's':
 				serial = optarg;
 				break;
+			case 'w':
+				fw_cache = optarg;
+				break;
 			case 'C':
 				my_hmid = strtoul(optarg, &endptr, 16);
 				if (*endptr != '\0') {
@@ -704,16 +835,11 @@ int main(int argc, char **argv)
 					exit(EXIT_FAILURE);
 				}
 				endptr++;
-				for (cnt = 0; cnt < 16; cnt++) {
-					if (*endptr == '\0' || *(endptr+1) == '\0' ||
-					    !validate_nibble(*endptr) ||
-					    !validate_nibble(*(endptr+1))) {
-						fprintf(stderr, "Invalid key!\n\n");
-						flash_ota_syntax(argv[0]);
-						exit(EXIT_FAILURE);
-					}
-					key[cnt] = ascii_to_nibble(*endptr) << 4 | ascii_to_nibble(*(endptr+1));
-					endptr += 2;
+				if ((strnlen(endptr, 32) < 32) ||
+				    (hex_decode_validate(key, (uint8_t*)endptr, 32) != 16)) {
+					fprintf(stderr, "Invalid key!\n\n");
+					flash_ota_syntax(argv[0]);
+					exit(EXIT_FAILURE);
 				}
 				break;
 			case 'S':
@@ -722,6 +848,12 @@ int main(int argc, char **argv)
 			case 'U':
 				uart = optarg;
 				break;
+			case 'L':
+				lgw = optarg;
+				break;
+			case 'P':
+				probes = atoi(optarg);
+				break;
 			case 'h':
 			case ':':
 			case '?':
@@ -733,6 +865,16 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (fw_file && fw_cache) {
+		fw = firmware_read_firmware(fw_file, debug);
+		if ((!fw) || (!firmware_write_cache(fw, fw_cache)))
+			exit(EXIT_FAILURE);
+
+		printf("Precompiled firmware written to %s\n", fw_cache);
+		firmware_free(fw);
+		exit(EXIT_SUCCESS);
+	}
+
 	if (!fw_file || (!serial && !hmid)) {
 		flash_ota_syntax(argv[0]);
 		exit(EXIT_FAILURE);
@@ -746,10 +888,11 @@ int main(int argc, char **argv)
 	memset(&dev, 0, sizeof(struct hm_dev));
 
 	if (culfw_dev) {
-		printf("Opening culfw-device at path %s with speed %u\n", culfw_dev, bps);
-		dev.culfw = culfw_init(culfw_dev, bps, parse_culfw, &rdata);
+		sopts.speed = bps ? bps : DEFAULT_CUL_BPS;
+		printf("Opening culfw-device at path %s with speed %u\n", culfw_dev, sopts.speed);
+		dev.culfw = culfw_init_opts(culfw_dev, &sopts, parse_culfw, &rdata);
 		if (!dev.culfw) {
-			fprintf(stderr, "Can't initialize CUL at %s with rate %u\n", culfw_dev, bps);
+			fprintf(stderr, "Can't initialize CUL at %s with rate %u\n", culfw_dev, sopts.speed);
 			exit(EXIT_FAILURE);
 		}
 		dev.type = DEVICE_TYPE_CULFW;
@@ -803,12 +946,9 @@ int main(int argc, char **argv)
 					printf("Setting AES-key\n");
 					snprintf(keybuf, sizeof(keybuf) - 1, "Ak%02x", kNo - 1);
 
-					for (i = 0; i < 16; i++) {
-						keybuf[4 + (i * 2)] = nibble_to_ascii((key[i] >> 4) & 0xf);
-						keybuf[4 + (i * 2) + 1] = nibble_to_ascii(key[i] & 0xf);
-					}
-					keybuf[4 + (i * 2) ] = '\r';
-					keybuf[4 + (i * 2) + 1] = '\n';
+					i = 4 + hex_encode(keybuf + 4, key, 16);
+					keybuf[i] = '\r';
+					keybuf[i + 1] = '\n';
 					culfw_send(dev.culfw, keybuf, strlen(keybuf)); // tsculfw: send ping to get credits info
 					pfd = culfw_poll(dev.culfw, 1000);
 					if ((pfd < 0) && errno) {
@@ -828,12 +968,25 @@ int main(int argc, char **argv)
 			fprintf(stderr, "\nThis version does _not_ support firmware upgrade mode, you need at least 1.58!\n");
 			exit(EXIT_FAILURE);
 		}
-	} else if (uart) {
+
+		if (probes > 0) {
+			struct serial_latency lat;
+
+			memset(&lat, 0, sizeof(lat));
+			culfw_probe_latency(dev.culfw, probes, &lat);
+			serial_latency_print("culfw", &lat);
+		}
+	} else if (uart || lgw) {
 		uint32_t new_hmid = my_hmid;
 
 		hmuartlgw_set_debug(debug);
 
-		dev.hmuartlgw = hmuart_init(uart, parse_hmuartlgw, &rdata, 1);
+		if (lgw) {
+			dev.hmuartlgw = hmlgw_init(lgw, parse_hmuartlgw, &rdata);
+		} else {
+			sopts.speed = bps ? bps : HMUARTLGW_SPEED;
+			dev.hmuartlgw = hmuart_init_opts(uart, &sopts, parse_hmuartlgw, &rdata, 1);
+		}
 		if (!dev.hmuartlgw) {
 			fprintf(stderr, "Can't initialize HM-MOD-UART\n");
 			exit(EXIT_FAILURE);
@@ -841,13 +994,13 @@ int main(int argc, char **argv)
 		dev.type = DEVICE_TYPE_HMUARTLGW;
 
 		out[0] = HMUARTLGW_APP_GET_HMID;
-		send_wait_hmuartlgw(&dev, &rdata, out, 1, HMUARTLGW_APP, HMUARTLGW_STATE_GET_HMID, HMUARTLGW_STATE_ACK_APP);
+		send_wait_hmuartlgw(&dev, &rdata, out, 1, HMUARTLGW_APP, HMUARTLGW_STATE_GET_HMID);
 
 		out[0] = HMUARTLGW_OS_GET_FIRMWARE;
-		send_wait_hmuartlgw(&dev, &rdata, out, 1, HMUARTLGW_OS, HMUARTLGW_STATE_GET_FIRMWARE, HMUARTLGW_STATE_DONE);
+		send_wait_hmuartlgw(&dev, &rdata, out, 1, HMUARTLGW_OS, HMUARTLGW_STATE_GET_FIRMWARE);
 
 		out[0] = HMUARTLGW_OS_GET_CREDITS;
-		send_wait_hmuartlgw(&dev, &rdata, out, 1, HMUARTLGW_OS, HMUARTLGW_STATE_GET_CREDITS, HMUARTLGW_STATE_DONE);
+		send_wait_hmuartlgw(&dev, &rdata, out, 1, HMUARTLGW_OS, HMUARTLGW_STATE_GET_CREDITS);
 
 		printf("HM-MOD-UART firmware version: %u.%u.%u, used credits: %u%%\n",
 			rdata.uartlgw_version[0],
@@ -864,6 +1017,14 @@ int main(int argc, char **argv)
 
 		printf("\nHM-MOD-UART opened\n\n");
 
+		if (probes > 0) {
+			struct serial_latency lat;
+
+			memset(&lat, 0, sizeof(lat));
+			hmuartlgw_probe_latency(dev.hmuartlgw, probes, &lat);
+			serial_latency_print("HM-MOD-UART", &lat);
+		}
+
 		if (new_hmid && (my_hmid != new_hmid)) {
 			printf("Changing hmid from %06x to %06x\n", my_hmid, new_hmid);
 
@@ -871,7 +1032,7 @@ int main(int argc, char **argv)
 			out[1] = (new_hmid >> 16) & 0xff;
 			out[2] = (new_hmid >> 8) & 0xff;
 			out[3] = new_hmid & 0xff;
-			send_wait_hmuartlgw(&dev, &rdata, out, 4, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP, HMUARTLGW_STATE_ACK_APP);
+			send_wait_hmuartlgw(&dev, &rdata, out, 4, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP);
 
 			my_hmid = new_hmid;
 		}
@@ -883,13 +1044,13 @@ int main(int argc, char **argv)
 			out[0] = HMUARTLGW_APP_SET_CURRENT_KEY;
 			memcpy(&(out[1]), key, 16);
 			out[17] = kNo;
-			send_wait_hmuartlgw(&dev, &rdata, out, 18, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP, HMUARTLGW_STATE_ACK_APP);
+			send_wait_hmuartlgw(&dev, &rdata, out, 18, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP);
 
 			memset(out, 0, sizeof(out));
 			out[0] = HMUARTLGW_APP_SET_OLD_KEY;
 			memcpy(&(out[1]), key, 16);
 			out[17] = kNo;
-			send_wait_hmuartlgw(&dev, &rdata, out, 18, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP, HMUARTLGW_STATE_ACK_APP);
+			send_wait_hmuartlgw(&dev, &rdata, out, 18, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP);
 		}
 	} else {
 		uint32_t new_hmid = my_hmid;
@@ -1031,7 +1192,7 @@ int main(int argc, char **argv)
 				out[5] = 0x00; /* WakeUp? */
 				out[6] = 0x00; /* WakeUp? */
 
-				send_wait_hmuartlgw(&dev, &rdata, out, 7, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP, HMUARTLGW_STATE_ACK_APP);
+				send_wait_hmuartlgw(&dev, &rdata, out, 7, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP);
 
 				break;
 		}
@@ -1127,7 +1288,7 @@ int main(int argc, char **argv)
 			out[5] = 0x00; /* WakeUp? */
 			out[6] = 0x00; /* WakeUp? */
 
-			send_wait_hmuartlgw(&dev, &rdata, out, 7, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP, HMUARTLGW_STATE_ACK_APP);
+			send_wait_hmuartlgw(&dev, &rdata, out, 7, HMUARTLGW_APP, HMUARTLGW_STATE_WAIT_APP);
 
 			break;
 	}
@@ -1203,8 +1364,15 @@ int main(int argc, char **argv)
 		fflush(stdout);
 	}
 
+	memset(&adapt, 0, sizeof(adapt));
+	adapt.payloadlen = max_payloadlen;
+	flash_start = serial_now_us();
+
 	for (block = 0; block < fw->fw_blocks; block++) {
-		int first;
+		int frame;	/* index of the frame within the block */
+		int frame_cnt;	/* retries of the current frame */
+		int block_failures = 0;
+		uint64_t block_start = serial_now_us();
 
 		len = fw->fw[block][2] << 8;
 		len |= fw->fw[block][3];
@@ -1216,16 +1384,16 @@ int main(int argc, char **argv)
 		if (debug)
 			hexdump(pos, len, "F> ");
 
-		first = 1;
 		cnt = 0;
+		frame = 0;
+		frame_cnt = 0;
 		do {
-			int payloadlen = max_payloadlen - 2;
+			int payloadlen = adapt.payloadlen - 2;
 			int ack = 0;
 
-			if (first) {
-				payloadlen = max_payloadlen;
-				first = 0;
-			}
+			/* The first frame of a block is larger */
+			if (frame == 0)
+				payloadlen = adapt.payloadlen;
 
 			if ((len - (pos - &(fw->fw[block][2]))) < payloadlen)
 				payloadlen = (len - (pos - &(fw->fw[block][2])));
@@ -1250,8 +1418,24 @@ int main(int argc, char **argv)
 
 			if (send_hm_message(&dev, &rdata, out)) {
 				pos += payloadlen;
+				frame++;
+				frame_cnt = 0;
+			} else if ((!ack) && (frame_cnt < MAX_FRAME_RETRIES)) {
+				/* Only the last frame of a block requests an ACK, so
+				 * an earlier one can only fail before it was sent and
+				 * is simply sent again */
+				frame_cnt++;
+				frame_retries++;
+				block_failures++;
+				frames_saved += frame;
+				printf("Flashing %d blocks: %04u/%04u %c", fw->fw_blocks, block + 1, fw->fw_blocks, twiddlie[msgnum % sizeof(twiddlie)]);
 			} else {
+				/* The device didn't confirm the block, start over */
 				pos = &(fw->fw[block][2]);
+				frame = 0;
+				frame_cnt = 0;
+				block_restarts++;
+				block_failures++;
 				cnt++;
 				if (cnt == MAX_RETRIES) {
 					fprintf(stderr, "\nToo many errors, giving up!\n");
@@ -1270,12 +1454,31 @@ int main(int argc, char **argv)
 			}
 		} while((pos - &(fw->fw[block][2])) < len);
 		msgid++;
+		flash_bytes += len;
+
+		if (adaptive) {
+			int prev = adapt.payloadlen;
+
+			adapt_payloadlen(&adapt, block_failures, len, serial_now_us() - block_start);
+			if (debug && (adapt.payloadlen != prev))
+				printf("Block %d: %u bytes/s, payloadlen %d -> %d\n",
+					block + 1, adapt.prev_rate, prev, adapt.payloadlen);
+		}
 	}
 
 	firmware_free(fw);
 
 	printf("\n");
 
+	flash_us = serial_now_us() - flash_start;
+	printf("Flashed %u bytes in %u.%01u s (%u bytes/s)\n", flash_bytes,
+		(unsigned int)(flash_us / 1000000), (unsigned int)((flash_us / 100000) % 10),
+		flash_us ? (unsigned int)(((uint64_t)flash_bytes * 1000000) / flash_us) : 0);
+
+	if (frame_retries || block_restarts)
+		printf("Resent %d frames individually (%d frames not resent), restarted %d blocks\n",
+			frame_retries, frames_saved, block_restarts);
+
 	if (!switch_speed(&dev, &rdata, 10)) {
 		fprintf(stderr, "Can't switch speed!\n");
 		exit(EXIT_FAILURE);
@@ -1321,11 +1524,13 @@ int main(int argc, char **argv)
 	switch(dev.type) {
 		case DEVICE_TYPE_HMCFGUSB:
 			hmcfgusb_close(dev.hmcfgusb);
-			hmcfgusb_exit();
 			break;
 		case DEVICE_TYPE_CULFW:
 			culfw_close(dev.culfw);
 			break;
+		case DEVICE_TYPE_HMUARTLGW:
+			hmuartlgw_close(dev.hmuartlgw);
+			break;
 	}
 
 	return EXIT_SUCCESS;
@@ -29,6 +29,7 @@
 #include <math.h>
 #include <poll.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 #include <libusb-1.0/libusb.h>
 
@@ -39,6 +40,7 @@
 #endif
 
 #include "hexdump.h"
+#include "reactor.h"
 #include "hmcfgusb.h"
 
 #define USB_TIMEOUT	10000
@@ -51,19 +53,27 @@
 #define ASYNC_SIZE	0x0040
 #define ASYNC_INTERVAL	32
 
+/* Number of IN transfers kept submitted at the same time */
+#define DEFAULT_IN_TRANSFERS	4
+#define MAX_IN_TRANSFERS	32
+
+/* Number of hmcfgusb_send_async() operations which can be in flight */
+#define OUT_QUEUE_LENGTH	8
+
 #define EP_OUT		0x02
 #define EP_IN		0x83
 
 #define INTERFACE	0
 
-static int quit = 0;
+/* Defaults for newly opened devices, all other state lives in the device */
 static int debug = 0;
-static int libusb_initialized = 0;
+static int in_transfers = DEFAULT_IN_TRANSFERS;
+static hmcfgusb_dump_fn dump = hexdump;
 
 /* Not in all libusb-1.0 versions, so we have to roll our own :-( */
 static char * usb_strerror(int e)
 {
-	static char unknerr[256];
+	static __thread char unknerr[256];
 
 	switch (e) {
 		case LIBUSB_SUCCESS:
@@ -99,14 +109,14 @@ static char * usb_strerror(int e)
 	return unknerr;
 }
 
-static libusb_device_handle *hmcfgusb_find(int vid, int pid, char *serial) {
+static libusb_device_handle *hmcfgusb_find(libusb_context *ctx, int vid, int pid, char *serial) {
 	libusb_device_handle *devh = NULL;
 	libusb_device **list;
 	ssize_t cnt;
 	ssize_t i;
 	int err;
 
-	cnt = libusb_get_device_list(NULL, &list);
+	cnt = libusb_get_device_list(ctx, &list);
 	if (cnt < 0) {
 		fprintf(stderr, "Can't get USB device list: %d\n", (int)cnt);
 		return NULL;
@@ -199,8 +209,8 @@ int hmcfgusb_send(struct hmcfgusb_dev *usbdev, unsigned char* send_data, int len
 	struct timeval tv_start, tv_end;
 	int msec;
 
-	if (debug) {
-		hexdump(send_data, len, "USB < ");
+	if (usbdev->debug) {
+		dump(send_data, len, "USB < ");
 	}
 
 	gettimeofday(&tv_start, NULL);
@@ -222,131 +232,421 @@ int hmcfgusb_send(struct hmcfgusb_dev *usbdev, unsigned char* send_data, int len
 
 	if (msec > 100) {
 		fprintf(stderr, "usb-transfer took more than 100ms (%dms), this may lead to timing problems!\n", msec);
-	} else if (debug) {
+	} else if (usbdev->debug) {
 		fprintf(stderr, "usb-transfer took %dms!\n", msec);
 	}
 
 	return 1;
 }
 
-static struct libusb_transfer *hmcfgusb_prepare_int(libusb_device_handle *devh, libusb_transfer_cb_fn cb, void *data, int in_size)
+struct hmcfgusb_out {
+	struct hmcfgusb_dev *dev;
+	struct libusb_transfer *transfer[2];	/* data, null frame */
+	unsigned char *buf;
+	int buf_size;
+	int pending;
+	int status;
+	int silent;
+	struct timeval tv_start;
+	hmcfgusb_send_cb_fn cb;
+	void *data;
+};
+
+static void LIBUSB_CALL hmcfgusb_out_done(struct libusb_transfer *transfer)
 {
-	unsigned char *data_buf;
-	struct libusb_transfer *transfer;
+	struct hmcfgusb_out *out = transfer->user_data;
+	struct timeval tv_end;
+	int msec;
+
+	if ((transfer->status != LIBUSB_TRANSFER_COMPLETED) &&
+	    (out->status == LIBUSB_TRANSFER_COMPLETED)) {
+		if (!out->silent)
+			fprintf(stderr, "Can't send data: %s\n", usb_strerror(transfer->status));
+		out->status = transfer->status;
+	}
+
+	out->pending--;
+	if (out->pending)
+		return;
+
+	out->dev->out_busy--;
+
+	gettimeofday(&tv_end, NULL);
+	msec = ((tv_end.tv_sec-out->tv_start.tv_sec)*1000)+((tv_end.tv_usec-out->tv_start.tv_usec)/1000);
+
+	if (msec > 100) {
+		fprintf(stderr, "usb-transfer took more than 100ms (%dms), this may lead to timing problems!\n", msec);
+	} else if (out->dev->debug) {
+		fprintf(stderr, "usb-transfer took %dms!\n", msec);
+	}
+
+	if (out->cb)
+		out->cb((out->status == LIBUSB_TRANSFER_COMPLETED), out->data);
+}
+
+static int hmcfgusb_out_alloc(struct hmcfgusb_dev *dev)
+{
+	int i, j;
+
+	dev->out = malloc(sizeof(struct hmcfgusb_out) * OUT_QUEUE_LENGTH);
+	if (!dev->out) {
+		perror("Can't allocate memory for usb out-queue");
+		return 0;
+	}
+
+	memset(dev->out, 0, sizeof(struct hmcfgusb_out) * OUT_QUEUE_LENGTH);
+
+	for (i = 0; i < OUT_QUEUE_LENGTH; i++) {
+		struct hmcfgusb_out *out = &(dev->out[i]);
+
+		out->dev = dev;
+		out->buf_size = ASYNC_SIZE;
+		out->buf = malloc(out->buf_size);
+		if (!out->buf) {
+			perror("Can't allocate memory for usb out-buffer");
+			return 0;
+		}
+
+		for (j = 0; j < 2; j++) {
+			out->transfer[j] = libusb_alloc_transfer(0);
+			if (!out->transfer[j]) {
+				fprintf(stderr, "Can't allocate memory for usb-transfer!\n");
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static void hmcfgusb_out_free(struct hmcfgusb_dev *dev)
+{
+	int i, j;
+
+	if (!dev->out)
+		return;
+
+	while (dev->out_busy) {
+		if (libusb_handle_events(dev->usb_ctx) < 0)
+			break;
+	}
+
+	for (i = 0; i < OUT_QUEUE_LENGTH; i++) {
+		for (j = 0; j < 2; j++) {
+			if (dev->out[i].transfer[j])
+				libusb_free_transfer(dev->out[i].transfer[j]);
+		}
+		free(dev->out[i].buf);
+	}
+
+	free(dev->out);
+	dev->out = NULL;
+}
+
+int hmcfgusb_send_async(struct hmcfgusb_dev *usbdev, unsigned char* send_data, int len, int done, hmcfgusb_send_cb_fn cb, void *data)
+{
+	struct hmcfgusb_out *out = NULL;
+	int n_transfers = 0;
 	int err;
+	int i;
 
-	data_buf = malloc(in_size);
-	if (!data_buf) {
-		fprintf(stderr, "Can't allocate memory for data-buffer!\n");
-		return NULL;
+	/* Only block when the queue is full */
+	while (1) {
+		for (i = 0; i < OUT_QUEUE_LENGTH; i++) {
+			if (!usbdev->out[i].pending) {
+				out = &(usbdev->out[i]);
+				break;
+			}
+		}
+
+		if (out)
+			break;
+
+		err = libusb_handle_events(usbdev->usb_ctx);
+		if (err < 0) {
+			fprintf(stderr, "libusb_handle_events: %s\n", usb_strerror(err));
+			return 0;
+		}
+
+		if (usbdev->quit)
+			return 0;
 	}
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer) {
-		fprintf(stderr, "Can't allocate memory for usb-transfer!\n");
-		free(data_buf);
-		return NULL;
+	if (len > out->buf_size) {
+		unsigned char *buf;
+
+		buf = realloc(out->buf, len);
+		if (!buf) {
+			perror("Can't reallocate usb out-buffer");
+			return 0;
+		}
+		out->buf = buf;
+		out->buf_size = len;
 	}
 
-	libusb_fill_interrupt_transfer(transfer, devh, EP_IN,
-			data_buf, in_size, cb, data, USB_TIMEOUT);
+	if (usbdev->debug && len) {
+		dump(send_data, len, "USB < ");
+	}
 
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	if (len)
+		memcpy(out->buf, send_data, len);
 
-	err = libusb_submit_transfer(transfer);
-	if (err != 0) {
-		fprintf(stderr, "Can't submit transfer: %s\n", usb_strerror(err));
-		libusb_free_transfer(transfer);
-		return NULL;
+	out->status = LIBUSB_TRANSFER_COMPLETED;
+	out->silent = !len;
+	out->cb = cb;
+	out->data = data;
+	gettimeofday(&(out->tv_start), NULL);
+
+	/* A zero-length send is a null frame by itself */
+	libusb_fill_interrupt_transfer(out->transfer[n_transfers++], usbdev->usb_devh, EP_OUT,
+			out->buf, len, hmcfgusb_out_done, out, USB_TIMEOUT);
+
+	if (done && len) {
+		libusb_fill_interrupt_transfer(out->transfer[n_transfers++], usbdev->usb_devh, EP_OUT,
+				out->buf, 0, hmcfgusb_out_done, out, USB_TIMEOUT);
 	}
 
-	return transfer;
+	for (i = 0; i < n_transfers; i++) {
+		err = libusb_submit_transfer(out->transfer[i]);
+		if (err != 0) {
+			fprintf(stderr, "Can't submit transfer: %s\n", usb_strerror(err));
+			if (!out->pending)
+				return 0;
+			/* The data is already on its way, fail via the callback */
+			out->status = LIBUSB_TRANSFER_ERROR;
+			break;
+		}
+		if (!out->pending)
+			usbdev->out_busy++;
+		out->pending++;
+	}
+
+	return 1;
 }
 
-struct hmcfgusb_cb_data {
+struct hmcfgusb_in {
 	struct hmcfgusb_dev *dev;
-	hmcfgusb_cb_fn cb;
-	void *data;
+	struct libusb_transfer *transfer;
+	unsigned char *spare;
+	int active;
 };
 
 static void LIBUSB_CALL hmcfgusb_interrupt(struct libusb_transfer *transfer)
 {
+	struct hmcfgusb_in *in = transfer->user_data;
+	struct hmcfgusb_dev *dev = in->dev;
+	enum libusb_transfer_status status = transfer->status;
+	unsigned char *buf = transfer->buffer;
+	int len = transfer->actual_length;
 	int err;
-	struct hmcfgusb_cb_data *cb_data;
 
-	cb_data = transfer->user_data;
+	dev->in_armed--;
+
+	/* Frames arriving during teardown are dropped, the clients are gone */
+	if (dev->closing) {
+		in->active = 0;
+		return;
+	}
 
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-		if (transfer->status != LIBUSB_TRANSFER_TIMED_OUT) {
-			if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
-				fprintf(stderr, "Interrupt transfer not completed: %s!\n", usb_strerror(transfer->status));
+	if (status != LIBUSB_TRANSFER_COMPLETED) {
+		if (status != LIBUSB_TRANSFER_TIMED_OUT) {
+			if (status != LIBUSB_TRANSFER_CANCELLED)
+				fprintf(stderr, "Interrupt transfer not completed: %s!\n", usb_strerror(status));
 
-			quit = EIO;
-			goto out;
+			dev->quit = EIO;
+			in->active = 0;
+			return;
 		}
 	} else {
-		if (cb_data && cb_data->cb) {
-			if (debug)
-				hexdump(transfer->buffer, transfer->actual_length, "USB > ");
+		dev->in_frames++;
+		if (!dev->in_armed)
+			dev->in_dry++;
 
-			if (!cb_data->cb(transfer->buffer, transfer->actual_length, cb_data->data)) {
-				quit = EIO;
-				goto out;
-			}
-		} else {
-			hexdump(transfer->buffer, transfer->actual_length, "> ");
-		}
+		/* Hand the filled buffer to the callback, re-arm with the spare one */
+		transfer->buffer = in->spare;
+		in->spare = buf;
 	}
 
+	/* Re-arm the endpoint before running the (possibly slow) callback */
 	err = libusb_submit_transfer(transfer);
 	if (err != 0) {
 		fprintf(stderr, "Can't re-submit transfer: %s\n", usb_strerror(err));
-		goto out;
+		in->active = 0;
+	} else {
+		dev->in_armed++;
 	}
 
-	return;
+	if (status != LIBUSB_TRANSFER_COMPLETED)
+		return;
+
+	if (dev->cb) {
+		if (dev->debug)
+			dump(buf, len, "USB > ");
+
+		if (!dev->cb(buf, len, dev->cb_data)) {
+			dev->quit = EIO;
+		}
+	} else {
+		dump(buf, len, "> ");
+	}
+}
+
+static void hmcfgusb_in_free(struct hmcfgusb_dev *dev)
+{
+	int i;
+
+	if (!dev->in)
+		return;
+
+	dev->closing = 1;
+	for (i = 0; i < dev->n_in; i++) {
+		if (dev->in[i].active)
+			libusb_cancel_transfer(dev->in[i].transfer);
+	}
+
+	while (dev->in_armed) {
+		if (libusb_handle_events(dev->usb_ctx) < 0)
+			break;
+	}
+
+	for (i = 0; i < dev->n_in; i++) {
+		if (dev->in[i].transfer) {
+			free(dev->in[i].transfer->buffer);
+			libusb_free_transfer(dev->in[i].transfer);
+		}
+		free(dev->in[i].spare);
+	}
+
+	free(dev->in);
+	dev->in = NULL;
+}
+
+static int hmcfgusb_in_alloc(struct hmcfgusb_dev *dev, int n)
+{
+	unsigned char *data_buf;
+	int err;
+	int i;
+
+	dev->in = malloc(sizeof(struct hmcfgusb_in) * n);
+	if (!dev->in) {
+		perror("Can't allocate memory for usb in-transfers");
+		return 0;
+	}
+
+	memset(dev->in, 0, sizeof(struct hmcfgusb_in) * n);
+	dev->n_in = n;
+
+	for (i = 0; i < n; i++) {
+		struct hmcfgusb_in *in = &(dev->in[i]);
+
+		in->dev = dev;
+
+		in->spare = malloc(ASYNC_SIZE);
+		data_buf = malloc(ASYNC_SIZE);
+		if ((!in->spare) || (!data_buf)) {
+			fprintf(stderr, "Can't allocate memory for data-buffer!\n");
+			free(data_buf);
+			return 0;
+		}
+
+		in->transfer = libusb_alloc_transfer(0);
+		if (!in->transfer) {
+			fprintf(stderr, "Can't allocate memory for usb-transfer!\n");
+			free(data_buf);
+			return 0;
+		}
+
+		libusb_fill_interrupt_transfer(in->transfer, dev->usb_devh, EP_IN,
+				data_buf, ASYNC_SIZE, hmcfgusb_interrupt, in, USB_TIMEOUT);
+
+		err = libusb_submit_transfer(in->transfer);
+		if (err != 0) {
+			fprintf(stderr, "Can't submit transfer: %s\n", usb_strerror(err));
+			return 0;
+		}
+
+		in->active = 1;
+		dev->in_armed++;
+	}
+
+	return 1;
+}
+
+/* libusb fds are registered with the device itself as data */
+static void LIBUSB_CALL hmcfgusb_pollfd_added(int fd, short events, void *user_data)
+{
+	struct hmcfgusb_dev *dev = user_data;
+
+	if (!reactor_add(dev->reactor, fd, events, dev))
+		dev->quit = EIO;
+}
+
+static void LIBUSB_CALL hmcfgusb_pollfd_removed(int fd, void *user_data)
+{
+	struct hmcfgusb_dev *dev = user_data;
+
+	reactor_del(dev->reactor, fd);
+}
 
-out:
-	libusb_free_transfer(transfer);
-	if (cb_data) {
-		if (cb_data->dev && cb_data->dev->transfer) {
-			cb_data->dev->transfer = NULL;
+static int hmcfgusb_reactor_init(struct hmcfgusb_dev *dev)
+{
+	const struct libusb_pollfd **usb_pfd = NULL;
+	int i;
+
+	dev->reactor = reactor_init();
+	if (!dev->reactor)
+		return 0;
+
+	dev->usb_timer = reactor_timer_add(dev->reactor, dev);
+	if (dev->usb_timer == -1)
+		return 0;
+
+	usb_pfd = libusb_get_pollfds(dev->usb_ctx);
+	if (!usb_pfd) {
+		fprintf(stderr, "Can't get FDset from libusb!\n");
+		return 0;
+	}
+
+	for (i = 0; usb_pfd[i]; i++) {
+		if (!reactor_add(dev->reactor, usb_pfd[i]->fd, usb_pfd[i]->events, dev)) {
+			free(usb_pfd);
+			return 0;
 		}
-		free(cb_data);
 	}
+
+	free(usb_pfd);
+
+	/* Keep track of fds libusb adds or removes later on */
+	libusb_set_pollfd_notifiers(dev->usb_ctx, hmcfgusb_pollfd_added, hmcfgusb_pollfd_removed, dev);
+
+	return 1;
 }
 
 struct hmcfgusb_dev *hmcfgusb_init(hmcfgusb_cb_fn cb, void *data, char *serial)
 {
+	libusb_context *ctx = NULL;
 	libusb_device_handle *devh = NULL;
-	const struct libusb_pollfd **usb_pfd = NULL;
 	struct hmcfgusb_dev *dev = NULL;
-	struct hmcfgusb_cb_data *cb_data = NULL;
 	int bootloader = 0;
 	int err;
-	int i;
 
-	if (!libusb_initialized) {
-		err = libusb_init(NULL);
-		if (err != 0) {
-			fprintf(stderr, "Can't initialize libusb: %s\n", usb_strerror(err));
-			return NULL;
-		}
+	/* Every device gets its own context, so devices don't share events */
+	err = libusb_init(&ctx);
+	if (err != 0) {
+		fprintf(stderr, "Can't initialize libusb: %s\n", usb_strerror(err));
+		return NULL;
 	}
-	libusb_initialized = 1;
 
-	devh = hmcfgusb_find(ID_VENDOR, ID_PRODUCT, serial);
+	devh = hmcfgusb_find(ctx, ID_VENDOR, ID_PRODUCT, serial);
 	if (!devh) {
-		devh = hmcfgusb_find(ID_VENDOR, ID_PRODUCT_BL, serial);
+		devh = hmcfgusb_find(ctx, ID_VENDOR, ID_PRODUCT_BL, serial);
 		if (!devh) {
 			if (serial) {
 				fprintf(stderr, "Can't find/open HM-CFG-USB with serial %s!\n", serial);
 			} else {
 				fprintf(stderr, "Can't find/open HM-CFG-USB!\n");
 			}
-#ifdef NEED_LIBUSB_EXIT
-			hmcfgusb_exit();
-#endif
+			libusb_exit(ctx);
 			return NULL;
 		}
 		bootloader = 1;
@@ -356,171 +656,125 @@ struct hmcfgusb_dev *hmcfgusb_init(hmcfgusb_cb_fn cb, void *data, char *serial)
 	if (!dev) {
 		perror("Can't allocate memory for hmcfgusb_dev");
 		libusb_close(devh);
-#ifdef NEED_LIBUSB_EXIT
-		hmcfgusb_exit();
-#endif
+		libusb_exit(ctx);
 		return NULL;
 	}
 
 	memset(dev, 0, sizeof(struct hmcfgusb_dev));
+	dev->usb_ctx = ctx;
 	dev->usb_devh = devh;
 	dev->bootloader = bootloader;
 	dev->opened_at = time(NULL);
+	dev->debug = debug;
 
-	cb_data = malloc(sizeof(struct hmcfgusb_cb_data));
-	if (!cb_data) {
-		perror("Can't allocate memory for hmcfgusb_cb_data");
-		free(dev);
-		libusb_close(devh);
-#ifdef NEED_LIBUSB_EXIT
-		hmcfgusb_exit();
-#endif
-		return NULL;
+	if (!hmcfgusb_out_alloc(dev)) {
+		hmcfgusb_out_free(dev);
+		goto out_close;
 	}
 
-	memset(cb_data, 0, sizeof(struct hmcfgusb_cb_data));
-
-	cb_data->dev = dev;
-	cb_data->cb = cb;
-	cb_data->data = data;
-
-	dev->transfer = hmcfgusb_prepare_int(devh, hmcfgusb_interrupt, cb_data, ASYNC_SIZE);
+	dev->cb = cb;
+	dev->cb_data = data;
 
-	if (!dev->transfer) {
+	if (!hmcfgusb_in_alloc(dev, in_transfers)) {
 		fprintf(stderr, "Can't prepare async device io!\n");
-		free(dev);
-		free(cb_data);
-		libusb_close(devh);
-#ifdef NEED_LIBUSB_EXIT
-		hmcfgusb_exit();
-#endif
-		return NULL;
+		hmcfgusb_in_free(dev);
+		hmcfgusb_out_free(dev);
+		goto out_close;
 	}
 
-	usb_pfd = libusb_get_pollfds(NULL);
-	if (!usb_pfd) {
-		fprintf(stderr, "Can't get FDset from libusb!\n");
-		libusb_cancel_transfer(dev->transfer);
-		libusb_handle_events(NULL);
-		free(dev);
-		free(cb_data);
-		libusb_close(devh);
-#ifdef NEED_LIBUSB_EXIT
-		hmcfgusb_exit();
-#endif
-		return NULL;
+	if (!hmcfgusb_reactor_init(dev)) {
+		fprintf(stderr, "Can't set up event loop!\n");
+		libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+		hmcfgusb_in_free(dev);
+		hmcfgusb_out_free(dev);
+		reactor_close(dev->reactor);
+		goto out_close;
 	}
 
-	dev->n_usb_pfd = 0;
-	for(i = 0; usb_pfd[i]; i++)
-		dev->n_usb_pfd++;
-
-	dev->pfd = malloc(dev->n_usb_pfd * sizeof(struct pollfd));
-	if (!dev->pfd) {
-		perror("Can't allocate memory for poll-fds");
-		libusb_cancel_transfer(dev->transfer);
-		libusb_handle_events(NULL);
-		free(dev);
-		free(cb_data);
-		libusb_close(devh);
-#ifdef NEED_LIBUSB_EXIT
-		hmcfgusb_exit();
-#endif
-		return NULL;
-	}
-
-	memset(dev->pfd, 0, dev->n_usb_pfd * sizeof(struct pollfd));
-
-	for (i = 0; i < dev->n_usb_pfd; i++) {
-		dev->pfd[i].fd = usb_pfd[i]->fd;
-		dev->pfd[i].events = usb_pfd[i]->events;
-		dev->pfd[i].revents = 0;
-	}
-
-	free(usb_pfd);
-
-	dev->n_pfd = dev->n_usb_pfd;
-
-	quit = 0;
-
 	return dev;
+
+out_close:
+	free(dev);
+	libusb_close(devh);
+	libusb_exit(ctx);
+	return NULL;
 }
 
 int hmcfgusb_add_pfd(struct hmcfgusb_dev *dev, int fd, short events)
 {
-	dev->n_pfd++;
-	dev->pfd = realloc(dev->pfd, dev->n_pfd * sizeof(struct pollfd));
-	if (!dev->pfd) {
-		perror("Can't realloc poll-fds");
-		return 0;
-	}
+	return reactor_add(dev->reactor, fd, events, NULL);
+}
 
-	dev->pfd[dev->n_pfd-1].fd = fd;
-	dev->pfd[dev->n_pfd-1].events = events;
-	dev->pfd[dev->n_pfd-1].revents = 0;
+int hmcfgusb_mod_pfd(struct hmcfgusb_dev *dev, int fd, short events)
+{
+	return reactor_mod(dev->reactor, fd, events);
+}
 
-	return 1;
+int hmcfgusb_del_pfd(struct hmcfgusb_dev *dev, int fd)
+{
+	return reactor_del(dev->reactor, fd);
 }
 
 int hmcfgusb_poll(struct hmcfgusb_dev *dev, int timeout)
 {
+	struct reactor_event ev[REACTOR_MAX_EVENTS];
 	struct timeval tv;
 	int usb_event = 0;
 	int timed_out = 0;
 	int i;
 	int n;
-	int fd_n;
 	int err;
 
 	errno = 0;
 
 	memset(&tv, 0, sizeof(tv));
-	err = libusb_get_next_timeout(NULL, &tv);
+	err = libusb_get_next_timeout(dev->usb_ctx, &tv);
 	if (err < 0) {
 		fprintf(stderr, "libusb_get_next_timeout: %s\n", usb_strerror(err));
 		errno = EIO;
 		return -1;
 	} else if (err == 0) {
 		/* No pending timeout or a sane platform */
+		reactor_timer_set(dev->reactor, dev->usb_timer, NULL);
 	} else {
 		if ((tv.tv_sec == 0) && (tv.tv_usec == 0)) {
 			usb_event = 1;
-		} else if ((tv.tv_sec * 1000) < timeout) {
-			timeout = tv.tv_sec * 1000;
+		} else {
+			reactor_timer_set(dev->reactor, dev->usb_timer, &tv);
 		}
 	}
 
 	if (!usb_event) {
-		for (i = 0; i < dev->n_pfd; i++) {
-			dev->pfd[i].revents = 0;
-		}
-
-		n = poll(dev->pfd, dev->n_pfd, timeout);
+		n = reactor_wait(dev->reactor, ev, REACTOR_MAX_EVENTS, timeout);
 		if (n < 0) {
-			perror("poll");
+			perror("epoll_wait");
 			errno = 0;
 			return -1;
 		} else if (n == 0) {
-			usb_event = 1;
-			timed_out = 1;
+			if (errno == ETIMEDOUT) {
+				usb_event = 1;
+				timed_out = 1;
+			}
 		} else {
-			for (fd_n = 0; fd_n < dev->n_pfd; fd_n++) {
-				if (dev->pfd[fd_n].revents) {
-					if (fd_n < dev->n_usb_pfd) {
-						usb_event = 1;
-						break;
-					} else {
-						errno = 0;
-						return dev->pfd[fd_n].fd;
-					}
+			/* libusb fds and the libusb timer carry the device as data */
+			for (i = 0; i < n; i++) {
+				if (ev[i].data == dev) {
+					usb_event = 1;
+					break;
 				}
 			}
+
+			/* Other ready fds are reported again on the next call */
+			if (!usb_event) {
+				errno = 0;
+				return ev[0].fd;
+			}
 		}
 	}
 
 	if (usb_event) {
 		memset(&tv, 0, sizeof(tv));
-		err = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+		err = libusb_handle_events_timeout_completed(dev->usb_ctx, &tv, NULL);
 		if (err < 0) {
 			fprintf(stderr, "libusb_handle_events_timeout_completed: %s\n", usb_strerror(err));
 			errno = EIO;
@@ -529,9 +783,9 @@ int hmcfgusb_poll(struct hmcfgusb_dev *dev, int timeout)
 	}
 
 	errno = 0;
-	if (quit) {
-		fprintf(stderr, "closing device-connection due to error %d\n", quit);
-		errno = quit;
+	if (dev->quit) {
+		fprintf(stderr, "closing device-connection due to error %d\n", dev->quit);
+		errno = dev->quit;
 	}
 
 	if (timed_out)
@@ -576,33 +830,38 @@ void hmcfgusb_close(struct hmcfgusb_dev *dev)
 {
 	int err;
 
-	if (dev->transfer) {
-		libusb_cancel_transfer(dev->transfer);
-		libusb_handle_events(NULL);
-	}
+	hmcfgusb_in_free(dev);
+	hmcfgusb_out_free(dev);
 
 	err = libusb_release_interface(dev->usb_devh, INTERFACE);
 	if ((err != 0)) {
 		fprintf(stderr, "Can't release interface: %s\n", usb_strerror(err));
 	}
 
+	libusb_set_pollfd_notifiers(dev->usb_ctx, NULL, NULL, NULL);
+
 	libusb_close(dev->usb_devh);
-#ifdef NEED_LIBUSB_EXIT
-	hmcfgusb_exit();
-#endif
-	free(dev->pfd);
+	libusb_exit(dev->usb_ctx);
+	reactor_close(dev->reactor);
 	free(dev);
 }
 
-void hmcfgusb_exit(void)
+void hmcfgusb_set_debug(int d)
 {
-	if (libusb_initialized) {
-		libusb_exit(NULL);
-		libusb_initialized = 0;
-	}
+	debug = d;
 }
 
-void hmcfgusb_set_debug(int d)
+void hmcfgusb_set_dump(hmcfgusb_dump_fn fn)
 {
-	debug = d;
+	dump = fn ? fn : hexdump;
+}
+
+int hmcfgusb_set_in_transfers(int n)
+{
+	if ((n < 1) || (n > MAX_IN_TRANSFERS))
+		return 0;
+
+	in_transfers = n;
+
+	return 1;
 }
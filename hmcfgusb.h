@@ -22,24 +22,47 @@
  */
 
 typedef int (*hmcfgusb_cb_fn)(uint8_t *buf, int buf_len, void *data);
+typedef void (*hmcfgusb_send_cb_fn)(int success, void *data);
+typedef void (*hmcfgusb_dump_fn)(unsigned char *buf, int len, char *prefix);
 
+struct hmcfgusb_in;
+struct hmcfgusb_out;
+struct reactor;
+
+/* All state of an opened device lives here, different devices can be
+ * used from different threads. */
 struct hmcfgusb_dev {
+	libusb_context *usb_ctx;
 	libusb_device_handle *usb_devh;
-	struct libusb_transfer *transfer;
-	int n_usb_pfd;
-	struct pollfd *pfd;
-	int n_pfd;
+	hmcfgusb_cb_fn cb;
+	void *cb_data;
+	struct hmcfgusb_in *in;
+	int n_in;
+	int in_armed;
+	int closing;	/* in-transfers are being cancelled, don't re-arm */
+	unsigned long in_frames;
+	unsigned long in_dry;	/* frames received while no other transfer was armed */
+	struct hmcfgusb_out *out;
+	int out_busy;
+	struct reactor *reactor;	/* libusb fds, added fds and timers */
+	int usb_timer;
 	int bootloader;
 	time_t opened_at;
+	int quit;	/* errno of a fatal error, reported by hmcfgusb_poll */
+	int debug;
 };
 
 int hmcfgusb_send(struct hmcfgusb_dev *usbdev, unsigned char* send_data, int len, int done);
+int hmcfgusb_send_async(struct hmcfgusb_dev *usbdev, unsigned char* send_data, int len, int done, hmcfgusb_send_cb_fn cb, void *data);
 int hmcfgusb_send_null_frame(struct hmcfgusb_dev *usbdev, int silent);
 struct hmcfgusb_dev *hmcfgusb_init(hmcfgusb_cb_fn cb, void *data, char *serial);
 int hmcfgusb_add_pfd(struct hmcfgusb_dev *dev, int fd, short events);
+int hmcfgusb_mod_pfd(struct hmcfgusb_dev *dev, int fd, short events);
+int hmcfgusb_del_pfd(struct hmcfgusb_dev *dev, int fd);
 int hmcfgusb_poll(struct hmcfgusb_dev *dev, int timeout);
 void hmcfgusb_enter_bootloader(struct hmcfgusb_dev *dev);
 void hmcfgusb_leave_bootloader(struct hmcfgusb_dev *dev);
 void hmcfgusb_close(struct hmcfgusb_dev *dev);
-void hmcfgusb_exit(void);
-void hmcfgusb_set_debug(int d);
+void hmcfgusb_set_debug(int d);	/* default for devices opened afterwards */
+int hmcfgusb_set_in_transfers(int n);
+void hmcfgusb_set_dump(hmcfgusb_dump_fn fn);
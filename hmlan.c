@@ -0,0 +1,140 @@
+/* HMLAN frame formatting
+ *
+ * Copyright (c) 2013-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+#include "hmlan.h"
+
+const struct format_field format_h_old[] = {
+	{ 0, FLAG_LENGTH_BYTE },
+	{ 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 0, FLAG_COMMA_BEFORE | FLAG_LENGTH_BYTE },
+	{ 3, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 3, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 4, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_NL },
+	FORMAT_END
+};
+
+/* Firmware >= 0.967 */
+const struct format_field format_h[] = {
+	{ 0, FLAG_LENGTH_BYTE },
+	{ 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 0, FLAG_COMMA_BEFORE | FLAG_LENGTH_BYTE },
+	{ 3, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 3, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 4, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_NL },
+	FORMAT_END
+};
+
+const struct format_field format_e[] = {
+	{ 3, FLAG_FORMAT_HEX },
+	{ 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 4, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 0, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_LENGTH_BYTE | FLAG_NL },
+	FORMAT_END
+};
+
+const struct format_field format_r[] = {
+	{ 4, FLAG_FORMAT_HEX },
+	{ 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 4, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 0, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_LENGTH_BYTE | FLAG_NL },
+	FORMAT_END
+};
+
+const struct format_field format_i[] = {
+	{ 1, FLAG_FORMAT_HEX },
+	{ 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE },
+	{ 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_NL },
+	FORMAT_END
+};
+
+const struct format_field format_g[] = {
+	{ 1, FLAG_FORMAT_HEX | FLAG_NL },
+	FORMAT_END
+};
+
+/* Format frame type and all fields described by fmt, returns the output length */
+int format_frame(const struct format_field *fmt, uint8_t *buf, int buf_len, uint8_t *out, int outlen)
+{
+	uint8_t *inpos = buf + 1;
+	uint8_t *inend = buf + buf_len;
+	uint8_t *outpos = out;
+	int len;
+
+	/* Every field writes at most 5 bytes per input byte (plus a final CR/LF) */
+	if ((buf_len < 1) || (outlen < 3 + (buf_len * 5)))
+		return 0;
+
+	*outpos++ = buf[0];
+
+	for (; fmt->len >= 0; fmt++) {
+		len = fmt->len;
+
+		if (fmt->flags & FLAG_COMMA_BEFORE)
+			*outpos++ = ',';
+
+		if (fmt->flags & FLAG_LENGTH_BYTE) {
+			if (inpos >= inend) {
+				fprintf(stderr, "Not enough input available!\n");
+				continue;
+			}
+			len = *inpos++;
+		}
+
+		if ((inpos + len) > inend) {
+			fprintf(stderr, "Not enough input available!\n");
+			continue;
+		}
+
+		if (fmt->flags & FLAG_FORMAT_HEX) {
+			outpos += hex_encode((char*)outpos, inpos, len);
+			inpos += len;
+		} else {
+			memcpy(outpos, inpos, len);
+			outpos += len;
+			inpos += len;
+		}
+
+		if (fmt->flags & FLAG_COMMA_AFTER)
+			*outpos++ = ',';
+
+		if (fmt->flags & FLAG_NL) {
+			*outpos++ = '\r';
+			*outpos++ = '\n';
+		}
+	}
+
+	return outpos - out;
+}
@@ -0,0 +1,46 @@
+/* HMLAN frame formatting
+ *
+ * Copyright (c) 2013-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define	FLAG_LENGTH_BYTE	(1<<0)
+#define	FLAG_FORMAT_HEX		(1<<1)
+#define	FLAG_COMMA_BEFORE	(1<<2)
+#define	FLAG_COMMA_AFTER	(1<<3)
+#define	FLAG_NL			(1<<4)
+#define	FLAG_IGNORE_COMMAS	(1<<5)
+
+/* One field of a frame sent to the LAN client */
+struct format_field {
+	int len;	/* ignored with FLAG_LENGTH_BYTE */
+	int flags;
+};
+
+#define FORMAT_END	{ -1, 0 }
+
+extern const struct format_field format_h_old[];
+extern const struct format_field format_h[];
+extern const struct format_field format_e[];
+extern const struct format_field format_r[];
+extern const struct format_field format_i[];
+extern const struct format_field format_g[];
+
+int format_frame(const struct format_field *fmt, uint8_t *buf, int buf_len, uint8_t *out, int outlen);
@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
@@ -41,18 +42,39 @@
 #include <libusb-1.0/libusb.h>
 
 #include "version.h"
-#include "hexdump.h"
 #include "hmcfgusb.h"
 #include "util.h"
+#include "hmlan.h"
+#include "logger.h"
+#include "timerwheel.h"
 
 #define PID_FILE "/var/run/hmland.pid"
 
-#define POLL_TIMEOUT_MS		250	/* Wake up device/bus at least once every 250ms */
+#define POLL_TIMEOUT_MS		250	/* Wake up device/bus at least once every 250ms after USB activity */
+#define KEEPALIVE_MAX_MS	1000	/* ...backing off to this interval while idle */
+#define HANDSHAKE_RETRY_MS	250
+#define REBOOT_RETRY_MS		1000
+#define REBOOT_MAX_WAIT_S	86400	/* longer waits are split, timer_add() takes an int of ms */
+#define STATS_INTERVAL_MS	60000
 #define DEFAULT_REBOOT_SECONDS	86400
 #define LAN_READ_CHUNK_SIZE	2048
 /* Don't allow remote clients to consume all of our memory */
 #define LAN_MAX_LINE_LENGTH	4096
 #define LAN_MAX_BUF_LENGTH	1048576
+/* Room for one maximum-length line plus one read() */
+#define LAN_READ_BUF_LENGTH	(LAN_MAX_LINE_LENGTH + 1 + LAN_READ_CHUNK_SIZE)
+#if LAN_READ_BUF_LENGTH > LAN_MAX_BUF_LENGTH
+#error LAN_READ_BUF_LENGTH exceeds LAN_MAX_BUF_LENGTH
+#endif
+/* Per-client output buffer in multi-client mode */
+#define LAN_CLIENT_QUEUE_LENGTH	65536
+#define DEFAULT_MAX_CLIENTS	1
+/* Frames kept for the next client while no client is connected (-k) */
+#define LAN_BACKLOG_FRAMES	32
+#define LAN_FRAME_LENGTH	256
+#define LAN_BACKLOG_SECONDS	10
+/* Frames held back until the device answered the 'K' handshake */
+#define LAN_HOLD_FRAMES		128
 
 extern char *optarg;
 
@@ -64,135 +86,88 @@ static int reboot_seconds = 0;
 static int reboot_at_hour = -1;
 static int reboot_at_minute = -1;
 static int reboot_set = 0;
-static uint8_t *lan_read_buf = NULL;
-static int lan_read_buflen = 0;
 static char *serial = NULL;
 
-struct queued_rx {
-	char *rx;
+enum slow_client_policy {
+	SLOW_CLIENT_DROP_OLDEST,
+	SLOW_CLIENT_DISCONNECT,
+};
+
+struct lan_client {
+	int fd_in;
+	int fd_out;
+	int remote;
+	in_addr_t addr;
+	int closing;
+	short events;
+	uint8_t read_buf[LAN_READ_BUF_LENGTH];
+	int read_buflen;
+	uint8_t *out_buf;	/* NULL: blocking writes to fd_out */
+	int out_start;
+	int out_len;
+	int out_partial;
+	unsigned long dropped;
+};
+
+static struct lan_client *clients = NULL;
+static int n_clients = 0;
+static int max_clients = DEFAULT_MAX_CLIENTS;
+static enum slow_client_policy slow_client_policy = SLOW_CLIENT_DROP_OLDEST;
+static int persistent = 0;
+
+enum frame_overflow_policy {
+	FRAME_DROP_OLDEST,
+	FRAME_DROP_NEWEST,
+};
+
+struct lan_frame {
+	time_t received;
 	int len;
-	struct queued_rx *next;
+	uint8_t data[LAN_FRAME_LENGTH];
 };
 
-static struct queued_rx *qrx = NULL;
+/* Preallocated FIFO of formatted LAN frames */
+struct frame_ring {
+	struct lan_frame *frames;
+	int size;
+	int first;
+	int count;
+	enum frame_overflow_policy policy;
+	unsigned long queued;
+	unsigned long dropped;
+};
+
+static struct lan_frame backlog_frames[LAN_BACKLOG_FRAMES];
+static struct frame_ring backlog = { backlog_frames, LAN_BACKLOG_FRAMES, 0, 0, FRAME_DROP_OLDEST, 0, 0 };
+static uint8_t cached_h[LAN_FRAME_LENGTH];
+static int cached_h_len = 0;
+
+static struct lan_frame held_frames[LAN_HOLD_FRAMES];
+static struct frame_ring held = { held_frames, LAN_HOLD_FRAMES, 0, 0, FRAME_DROP_OLDEST, 0, 0 };
 static int wait_for_h = 0;
 
-#define	FLAG_LENGTH_BYTE	(1<<0)
-#define	FLAG_FORMAT_HEX		(1<<1)
-#define	FLAG_COMMA_BEFORE	(1<<2)
-#define	FLAG_COMMA_AFTER	(1<<3)
-#define	FLAG_NL			(1<<4)
-#define	FLAG_IGNORE_COMMAS	(1<<5)
+static struct timerwheel timers;
+static struct timer keepalive_timer;
+static struct timer handshake_timer;
+static struct timer reboot_timer;
+static struct timer stats_timer;
+static int keepalive_ms = POLL_TIMEOUT_MS;
+static unsigned long wakeups = 0;
+static unsigned long timer_wakeups = 0;
 
 #define CHECK_SPACE(x)		if ((*outpos + x) > outend) { fprintf(stderr, "Not enough space!\n"); return 0; }
 #define CHECK_AVAIL(x)		if ((*inpos + x) > inend) { fprintf(stderr, "Not enough input available!\n"); return 0; }
 
-static void print_timestamp(FILE *f)
-{
-	struct timeval tv;
-	struct tm *tmp;
-	char ts[32];
-
-	gettimeofday(&tv, NULL);
-	tmp = localtime(&tv.tv_sec);
-	memset(ts, 0, sizeof(ts));
-	strftime(ts, sizeof(ts)-1, "%Y-%m-%d %H:%M:%S", tmp);
-	fprintf(f, "%s.%06ld: ", ts, tv.tv_usec);
-}
-
 static void write_log(char *buf, int len, char *fmt, ...)
 {
 	va_list ap;
-	int i;
 
 	if ((!logfile) && (!verbose))
 		return;
 
-	if (logfile)
-		print_timestamp(logfile);
-	if (verbose)
-		print_timestamp(stdout);
-
-	if (fmt) {
-		if (logfile) {
-			va_start(ap, fmt);
-			vfprintf(logfile, fmt, ap);
-			va_end(ap);
-		}
-		if (verbose) {
-			va_start(ap, fmt);
-			vprintf(fmt, ap);
-			va_end(ap);
-		}
-	}
-
-	if (buf && len) {
-		for (i = 0; i < len; i++) {
-			if (logfile)
-				fprintf(logfile, "%c", buf[i]);
-			if (verbose)
-				printf("%c", buf[i]);
-		}
-		if (logfile)
-			fprintf(logfile, "\n");
-		if (verbose)
-			printf("\n");
-	}
-	if (logfile)
-		fflush(logfile);
-}
-
-static int format_part_out(uint8_t **inpos, int inlen, uint8_t **outpos, int outlen, int len, int flags)
-{
-	uint8_t *buf_out = *outpos;
-	uint8_t *outend = *outpos + outlen;
-	uint8_t *inend = *inpos + inlen;
-	int i;
-
-	if (flags & FLAG_COMMA_BEFORE) {
-		CHECK_SPACE(1);
-		**outpos=',';
-		*outpos += 1;
-	}
-
-	if (flags & FLAG_LENGTH_BYTE) {
-		CHECK_AVAIL(1);
-		len = **inpos;
-		*inpos += 1;
-	}
-
-	if (flags & FLAG_FORMAT_HEX) {
-		CHECK_AVAIL(len);
-		CHECK_SPACE(len*2);
-		for (i = 0; i < len; i++) {
-			**outpos = nibble_to_ascii(((**inpos) & 0xf0) >> 4);
-			*outpos += 1;
-			**outpos = nibble_to_ascii(((**inpos) & 0xf));
-			*inpos += 1; *outpos += 1;
-		}
-	} else {
-		CHECK_AVAIL(len);
-		CHECK_SPACE(len);
-		memcpy(*outpos, *inpos, len);
-		*outpos += len;
-		*inpos += len;
-	}
-
-	if (flags & FLAG_COMMA_AFTER) {
-		CHECK_SPACE(1);
-		**outpos=',';
-		*outpos += 1;
-	}
-
-	if (flags & FLAG_NL) {
-		CHECK_SPACE(2);
-		**outpos='\r';
-		*outpos += 1;
-		**outpos='\n';
-		*outpos += 1;
-	}
-
-	return *outpos - buf_out;
+	va_start(ap, fmt);
+	logger_vlog((uint8_t*)buf, len, fmt, ap);
+	va_end(ap);
 }
 
 static int parse_part_in(uint8_t **inpos, int inlen, uint8_t **outpos, int outlen, int flags)
@@ -223,6 +198,9 @@ static int parse_part_in(uint8_t **inpos, int inlen, uint8_t **outpos, int outle
 	}
 
 	while(*inpos < inend) {
+		uint8_t *end;
+		int len, n, r;
+
 		if (**inpos == ',') {
 			*inpos += 1;
 			if (!(flags & FLAG_IGNORE_COMMAS))
@@ -231,55 +209,442 @@ static int parse_part_in(uint8_t **inpos, int inlen, uint8_t **outpos, int outle
 			continue;
 		}
 
-		CHECK_SPACE(1);
-		CHECK_AVAIL(2);
+		end = memchr(*inpos, ',', inend - *inpos);
+		if (!end)
+			end = inend;
+		len = (end - *inpos + 1) / 2;
+
+		n = len;
+		if (n > (outend - *outpos))
+			n = outend - *outpos;
+		if (n > ((inend - *inpos) / 2))
+			n = (inend - *inpos) / 2;
+
+		r = hex_decode_validate(*outpos, *inpos, n * 2);
+		*inpos += r * 2; *outpos += r;
+
+		/* Non-hex characters are decoded leniently as before */
+		for (; r < n; r++) {
+			**outpos = ascii_to_nibble(**inpos) << 4;
+			*inpos += 1;
+			**outpos |= ascii_to_nibble(**inpos);
+			*inpos += 1; *outpos += 1;
+		}
 
-		**outpos = ascii_to_nibble(**inpos) << 4;
-		*inpos += 1;
-		**outpos |= ascii_to_nibble(**inpos);
-		*inpos += 1; *outpos += 1;
+		if (n < len) {
+			CHECK_SPACE(1);
+			CHECK_AVAIL(2);
+		}
 	}
 
 	return *outpos - buf_out;
 }
 
+static void client_log(struct lan_client *c, char *fmt)
+{
+	if (!c->remote)
+		return;
+
+	write_log(NULL, 0, fmt,
+			(c->addr & 0xff000000) >> 24,
+			(c->addr & 0x00ff0000) >> 16,
+			(c->addr & 0x0000ff00) >> 8,
+			(c->addr & 0x000000ff));
+}
+
+static int client_queue(struct lan_client *c, uint8_t *buf, int len)
+{
+	if (len > LAN_CLIENT_QUEUE_LENGTH)
+		return 0;
+
+	while ((c->out_len + len) > LAN_CLIENT_QUEUE_LENGTH) {
+		uint8_t *first = c->out_buf + c->out_start;
+		uint8_t *nl;
+		int keep = 0;
+		int drop;
+
+		if (slow_client_policy == SLOW_CLIENT_DISCONNECT)
+			return 0;
+
+		/* Never drop a frame which is already partially sent */
+		if (c->out_partial) {
+			nl = memchr(first, '\n', c->out_len);
+			if (!nl)
+				return 0;
+			keep = (nl - first) + 1;
+		}
+
+		nl = memchr(first + keep, '\n', c->out_len - keep);
+		if (!nl)
+			return 0;
+
+		drop = (nl - (first + keep)) + 1;
+		memmove(first + keep, first + keep + drop, c->out_len - (keep + drop));
+		c->out_len -= drop;
+		c->dropped++;
+	}
+
+	if ((c->out_start + c->out_len + len) > LAN_CLIENT_QUEUE_LENGTH) {
+		memmove(c->out_buf, c->out_buf + c->out_start, c->out_len);
+		c->out_start = 0;
+	}
+
+	memcpy(c->out_buf + c->out_start + c->out_len, buf, len);
+	c->out_len += len;
+
+	return 1;
+}
+
+static void client_flush(struct lan_client *c)
+{
+	int w;
+
+	if (c->closing || !c->out_len)
+		return;
+
+	w = write(c->fd_out, c->out_buf + c->out_start, c->out_len);
+	if (w < 0) {
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			if (errno != EPIPE && errno != ECONNRESET)
+				perror("write");
+			c->closing = 1;
+		}
+		return;
+	} else if (w == 0) {
+		return;
+	}
+
+	c->out_start += w;
+	c->out_len -= w;
+	c->out_partial = (c->out_buf[c->out_start - 1] != '\n');
+
+	if (!c->out_len)
+		c->out_start = 0;
+}
+
+static int client_send(struct lan_client *c, uint8_t *buf, int len)
+{
+	int w;
+
+	if (c->closing)
+		return 1;
+
+	if (!c->out_buf) {
+		w = write(c->fd_out, buf, len);
+		if (w <= 0) {
+			perror("write");
+			c->closing = 1;
+			return 0;
+		}
+		return 1;
+	}
+
+	if (!client_queue(c, buf, len)) {
+		if (verbose)
+			printf("Client too slow, closing connection!\n");
+		c->closing = 1;
+		return 1;
+	}
+
+	client_flush(c);
+
+	return 1;
+}
+
+static int client_sendv(struct lan_client *c, struct iovec *iov, int iovcnt)
+{
+	int total = 0;
+	int w;
+	int i;
+
+	if (c->closing)
+		return 1;
+
+	if (!c->out_buf) {
+		for (i = 0; i < iovcnt; i++)
+			total += iov[i].iov_len;
+
+		while (total > 0) {
+			w = writev(c->fd_out, iov, iovcnt);
+			if (w <= 0) {
+				perror("writev");
+				c->closing = 1;
+				return 0;
+			}
+
+			/* Short write, skip what was already sent */
+			total -= w;
+			while (iovcnt && ((size_t)w >= iov->iov_len)) {
+				w -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			if (iovcnt) {
+				iov->iov_base = (uint8_t*)iov->iov_base + w;
+				iov->iov_len -= w;
+			}
+		}
+		return 1;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		if (!client_queue(c, iov[i].iov_base, iov[i].iov_len)) {
+			if (verbose)
+				printf("Client too slow, closing connection!\n");
+			c->closing = 1;
+			return 1;
+		}
+	}
+
+	client_flush(c);
+
+	return 1;
+}
+
+static int frame_ring_add(struct frame_ring *r, uint8_t *buf, int len)
+{
+	struct lan_frame *f;
+
+	if (len > LAN_FRAME_LENGTH) {
+		r->dropped++;
+		return 0;
+	}
+
+	if (r->count == r->size) {
+		r->dropped++;
+		if (r->policy == FRAME_DROP_NEWEST)
+			return 0;
+
+		r->first = (r->first + 1) % r->size;
+		r->count--;
+	}
+
+	f = &(r->frames[(r->first + r->count) % r->size]);
+	f->received = time(NULL);
+	f->len = len;
+	memcpy(f->data, buf, len);
+	r->count++;
+	r->queued++;
+
+	return 1;
+}
+
+static void frame_ring_clear(struct frame_ring *r)
+{
+	r->first = 0;
+	r->count = 0;
+}
+
+/* Collect (and log) all frames younger than max_age seconds, oldest first */
+static int frame_ring_iov(struct frame_ring *r, struct iovec *iov, int max_age)
+{
+	time_t now = time(NULL);
+	int n = 0;
+	int i;
+
+	for (i = 0; i < r->count; i++) {
+		struct lan_frame *f = &(r->frames[(r->first + i) % r->size]);
+
+		if (max_age && ((now - f->received) > max_age))
+			continue;
+
+		write_log((char*)f->data, f->len-2, "LAN < ");
+		iov[n].iov_base = f->data;
+		iov[n].iov_len = f->len;
+		n++;
+	}
+
+	return n;
+}
+
+static void backlog_add(uint8_t *buf, int len)
+{
+	if (buf[0] == 'H')
+		return;
+
+	frame_ring_add(&backlog, buf, len);
+}
+
+/* Bring a newly connected client up to date without waiting for the device */
+static void backlog_replay(struct lan_client *c)
+{
+	struct iovec iov[LAN_BACKLOG_FRAMES + 1];
+	int n = 0;
+
+	if (cached_h_len && !wait_for_h) {
+		write_log((char*)cached_h, cached_h_len-2, "LAN < ");
+		iov[n].iov_base = cached_h;
+		iov[n].iov_len = cached_h_len;
+		n++;
+	}
+
+	n += frame_ring_iov(&backlog, iov + n, LAN_BACKLOG_SECONDS);
+	if (n)
+		client_sendv(c, iov, n);
+
+	frame_ring_clear(&backlog);
+}
+
+static int lan_send(uint8_t *buf, int len)
+{
+	int ret = 1;
+	int i;
+
+	if (persistent && !n_clients) {
+		backlog_add(buf, len);
+		return 1;
+	}
+
+	for (i = 0; i < n_clients; i++) {
+		/* Clients come and go, the device stays open */
+		if (!client_send(&(clients[i]), buf, len) && !persistent)
+			ret = 0;
+	}
+
+	return ret;
+}
+
+static int lan_sendv(struct iovec *iov, int iovcnt)
+{
+	struct iovec client_iov[LAN_HOLD_FRAMES];
+	int ret = 1;
+	int i;
+
+	if (persistent && !n_clients) {
+		for (i = 0; i < iovcnt; i++)
+			backlog_add(iov[i].iov_base, iov[i].iov_len);
+		return 1;
+	}
+
+	for (i = 0; i < n_clients; i++) {
+		/* client_sendv() advances the iovec on short writes */
+		memcpy(client_iov, iov, sizeof(struct iovec) * iovcnt);
+		if (!client_sendv(&(clients[i]), client_iov, iovcnt) && !persistent)
+			ret = 0;
+	}
+
+	return ret;
+}
+
+static void keepalive_expired(struct timer *t, void *data)
+{
+	struct hmcfgusb_dev *dev = data;
+
+	/* periodically wakeup the device, less often the longer it is idle */
+	hmcfgusb_send_async(dev, NULL, 0, 0, NULL, NULL);
+
+	keepalive_ms *= 2;
+	if (keepalive_ms > KEEPALIVE_MAX_MS)
+		keepalive_ms = KEEPALIVE_MAX_MS;
+
+	timer_add(&timers, t, keepalive_ms);
+}
+
+static void handshake_expired(struct timer *t, void *data)
+{
+	struct hmcfgusb_dev *dev = data;
+	uint8_t out[0x40];
+
+	if (!wait_for_h)
+		return;
+
+	memset(out, 0, sizeof(out));
+	out[0] = 'K';
+	hmcfgusb_send_async(dev, out, sizeof(out), 1, NULL, NULL);
+
+	timer_add(&timers, t, HANDSHAKE_RETRY_MS);
+}
+
+static void schedule_reboot(void)
+{
+	struct hmcfgusb_dev *dev = reboot_timer.data;
+	time_t left;
+
+	/* Device not set up yet, comm() schedules the reboot */
+	if (!dev)
+		return;
+
+	if (!reboot_seconds) {
+		timer_del(&reboot_timer);
+		return;
+	}
+
+	left = (dev->opened_at + reboot_seconds) - time(NULL);
+	if (left < 0)
+		left = 0;
+	if (left > REBOOT_MAX_WAIT_S)
+		left = REBOOT_MAX_WAIT_S;
+
+	timer_add(&timers, &reboot_timer, left * 1000);
+}
+
+static void reboot_expired(struct timer *t, void *data)
+{
+	struct hmcfgusb_dev *dev = data;
+
+	/* Only an intermediate wakeup of a long reboot interval */
+	if (time(NULL) < (dev->opened_at + reboot_seconds)) {
+		schedule_reboot();
+		return;
+	}
+
+	if (verbose) {
+		printf("HM-CFG-USB running since %lu seconds, rebooting now...\n",
+			time(NULL) - dev->opened_at);
+	}
+	hmcfgusb_enter_bootloader(dev);
+
+	/* Device should be gone by then */
+	timer_add(&timers, t, REBOOT_RETRY_MS);
+}
+
+static void stats_expired(struct timer *t, void *data)
+{
+	static unsigned long last_logger_wakeups = 0;
+	unsigned long lw = logger_wakeups();
+
+	printf("%lu wakeups in the last minute, %lu of them for timers, %lu logger wakeups\n",
+		wakeups, timer_wakeups, lw - last_logger_wakeups);
+	wakeups = 0;
+	timer_wakeups = 0;
+	last_logger_wakeups = lw;
+
+	timer_add(&timers, t, STATS_INTERVAL_MS);
+}
+
 static int hmlan_format_out(uint8_t *buf, int buf_len, void *data)
 {
 	uint8_t out[1024];
-	uint8_t *outpos;
-	uint8_t *inpos;
+	int outlen;
 	uint16_t version;
-	int fd = *((int*)data);
-	int w;
 
 	if (buf_len < 1)
 		return 1;
 
-	memset(out, 0, sizeof(out));
-	outpos = out;
-	inpos = buf;
+	/* The device is busy, no need to wake it up for a while */
+	keepalive_ms = POLL_TIMEOUT_MS;
+	if (timer_pending(&keepalive_timer))
+		timer_add(&timers, &keepalive_timer, keepalive_ms);
 
-	format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 1, 0);
 	switch(buf[0]) {
 		case 'H':
-			if (impersonate_hmlanif) {
+			if (impersonate_hmlanif && (buf_len >= 8)) {
 				buf[5] = 'L';
 				buf[6] = 'A';
 				buf[7] = 'N';
 			}
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 0, FLAG_LENGTH_BYTE);
-			version = inpos[0] << 8;
-			version |= inpos[1];
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 0, FLAG_COMMA_BEFORE | FLAG_LENGTH_BYTE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 3, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 3, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 4, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
+
+			/* Firmware version follows the length-prefixed product name */
+			version = 0;
+			if ((buf_len >= 2) && ((buf[1] + 4) <= buf_len)) {
+				version = buf[buf[1] + 2] << 8;
+				version |= buf[buf[1] + 3];
+			}
+
 			if (version < 0x03c7) {
-				format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_NL);
+				outlen = format_frame(format_h_old, buf, buf_len, out, sizeof(out));
 			} else {
-				format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-				format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_NL);
+				outlen = format_frame(format_h, buf, buf_len, out, sizeof(out));
 			}
 
 			if (!reboot_set) {
@@ -295,100 +660,73 @@ static int hmlan_format_out(uint8_t *buf, int buf_len, void *data)
 					printf("Rebooting in %u seconds due to old firmware (0.%d)\n",
 						new_reboot_seconds, version);
 
-				reboot_seconds = new_reboot_seconds;
+				if (reboot_seconds != new_reboot_seconds) {
+					reboot_seconds = new_reboot_seconds;
+					schedule_reboot();
+				}
 			}
 
 			break;
 		case 'E':
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 3, FLAG_FORMAT_HEX);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 4, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 0, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_LENGTH_BYTE | FLAG_NL);
-
+			outlen = format_frame(format_e, buf, buf_len, out, sizeof(out));
 			break;
 		case 'R':
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 4, FLAG_FORMAT_HEX);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 4, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 2, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 0, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_LENGTH_BYTE | FLAG_NL);
-
+			outlen = format_frame(format_r, buf, buf_len, out, sizeof(out));
 			break;
 		case 'I':
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 1, FLAG_FORMAT_HEX);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE);
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 1, FLAG_FORMAT_HEX | FLAG_COMMA_BEFORE | FLAG_NL);
-
+			outlen = format_frame(format_i, buf, buf_len, out, sizeof(out));
 			break;
 		case 'G':
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), 1, FLAG_FORMAT_HEX | FLAG_NL);
-
+			outlen = format_frame(format_g, buf, buf_len, out, sizeof(out));
 			break;
 		default:
-			format_part_out(&inpos, (buf_len-(inpos-buf)), &outpos, (sizeof(out)-(outpos-out)), buf_len-1, FLAG_FORMAT_HEX | FLAG_NL);
-			hexdump(buf, buf_len, "Unknown> ");
+			{
+				struct format_field format_unknown[] = {
+					{ buf_len - 1, FLAG_FORMAT_HEX | FLAG_NL },
+					FORMAT_END
+				};
+
+				outlen = format_frame(format_unknown, buf, buf_len, out, sizeof(out));
+			}
+			logger_hexdump(buf, buf_len, "Unknown> ");
 			break;
 	}
 
+	if (outlen <= 0) {
+		fprintf(stderr, "Can't format frame of %d bytes for LAN, dropping it\n", buf_len);
+		return 1;
+	}
+
 	/* Queue packet until first respone to 'K' is received */
 	if (wait_for_h && buf[0] != 'H') {
-		struct queued_rx **rxp = &qrx;
-
-		while (*rxp)
-			rxp = &((*rxp)->next);
-
-		*rxp = malloc(sizeof(struct queued_rx));
-		if (!*rxp) {
-			perror("malloc");
-			return 0;
-		}
-
-		memset(*rxp, 0, sizeof(struct queued_rx));
-		(*rxp)->len = outpos-out;
-		(*rxp)->rx = malloc((*rxp)->len);
-		if (!(*rxp)->rx) {
-			perror("malloc");
-			return 0;
-		}
-		memset((*rxp)->rx, 0, (*rxp)->len);
-		memcpy((*rxp)->rx, out, (*rxp)->len);
-
+		frame_ring_add(&held, out, outlen);
 		return 1;
 	}
 
-	write_log((char*)out, outpos-out-2, "LAN < ");
+	if ((buf[0] == 'H') && ((outlen) <= sizeof(cached_h))) {
+		memcpy(cached_h, out, outlen);
+		cached_h_len = outlen;
+	}
+
+	write_log((char*)out, outlen-2, "LAN < ");
 
-	w = write(fd, out, outpos-out);
-	if (w <= 0) {
-		perror("write");
+	if (!lan_send(out, outlen))
 		return 0;
-	}
 
 	/* Send all queued packets */
 	if (wait_for_h) {
-		struct queued_rx *curr_rx = qrx;
-		struct queued_rx *last_rx;
-
-		while (curr_rx) {
-			write_log(curr_rx->rx, curr_rx->len-2, "LAN < ");
-
-			w = write(fd, curr_rx->rx, curr_rx->len);
-			if (w <= 0) {
-				perror("write");
-			}
-			last_rx = curr_rx;
-			curr_rx = curr_rx->next;
+		struct iovec iov[LAN_HOLD_FRAMES];
+		int n;
 
-			free(last_rx->rx);
-			free(last_rx);
-		}
+		n = frame_ring_iov(&held, iov, 0);
+		if (n)
+			lan_sendv(iov, n);
 
-		qrx = NULL;
+		if (verbose && (held.queued || held.dropped))
+			printf("Sent %d frames held back during handshake (%lu queued, %lu dropped so far)\n",
+				n, held.queued, held.dropped);
 
+		frame_ring_clear(&held);
 		wait_for_h = 0;
 	}
 
@@ -436,59 +774,67 @@ static int hmlan_parse_one(uint8_t *cmd, int last, void *data)
 			break;
 	}
 
-	hmcfgusb_send(dev, out, sizeof(out), 1);
+	hmcfgusb_send_async(dev, out, sizeof(out), 1, NULL, NULL);
 
 	return 1;
 }
 
-static int hmlan_parse_in(int fd, void *data)
+static int hmlan_parse_in(struct lan_client *c, void *data)
 {
-	uint8_t *newbuf;
+	uint8_t *start, *end, *eol, *cr, *lf;
 	int r;
-	int i;
 
-	newbuf = realloc(lan_read_buf, lan_read_buflen + LAN_READ_CHUNK_SIZE);
-	if (!newbuf) {
-		perror("realloc");
-		return 0;
-	}
-	lan_read_buf = newbuf;
-	r = read(fd, lan_read_buf + lan_read_buflen, LAN_READ_CHUNK_SIZE);
+	r = read(c->fd_in, c->read_buf + c->read_buflen, LAN_READ_BUF_LENGTH - c->read_buflen);
 	if (r > 0) {
-		lan_read_buflen += r;
-		if (lan_read_buflen > LAN_MAX_BUF_LENGTH) {
-			if (verbose)
-				printf("Our buffer is bigger than %d bytes (%d bytes), closing connection!\n", LAN_MAX_BUF_LENGTH, lan_read_buflen);
-			return -1;
-		}
-		while(lan_read_buflen > 0) {
-			int found = 0;
-
-			for (i = 0; i < lan_read_buflen; i++) {
-				if ((lan_read_buf[i] == '\r') || (lan_read_buf[i] == '\n')) {
-					if (i > 0)
-						hmlan_parse_one(lan_read_buf, i, data);
-					memmove(lan_read_buf, lan_read_buf + i + 1, lan_read_buflen - (i + 1));
-					lan_read_buflen -= (i + 1);
-					found = 1;
-					break;
-				}
-				if (i > LAN_MAX_LINE_LENGTH) {
-					if (verbose)
-						printf("Client sent more than %d bytes without newline, closing connection!\n", LAN_MAX_LINE_LENGTH);
-					return -1;
-				}
+		c->read_buflen += r;
+
+		start = c->read_buf;
+		end = c->read_buf + c->read_buflen;
+
+		/* Parse all complete lines in place. The next CR and LF are
+		 * kept until passed, so clients sending only one of them
+		 * don't get the rest of the buffer rescanned per line. */
+		cr = lf = NULL;
+		while (start < end) {
+			if (!cr || (cr < start)) {
+				cr = memchr(start, '\r', end - start);
+				if (!cr)
+					cr = end;
 			}
-			if (!found)
+			if (!lf || (lf < start)) {
+				lf = memchr(start, '\n', end - start);
+				if (!lf)
+					lf = end;
+			}
+
+			eol = (cr < lf) ? cr : lf;
+			if (eol == end)
 				break;
-			newbuf = realloc(lan_read_buf, lan_read_buflen);
-			if (lan_read_buflen && !newbuf) {
-				perror("realloc");
-				return 0;
+
+			if (eol - start > LAN_MAX_LINE_LENGTH) {
+				if (verbose)
+					printf("Client sent more than %d bytes without newline, closing connection!\n", LAN_MAX_LINE_LENGTH);
+				return -1;
 			}
-			lan_read_buf = newbuf;
+
+			if (eol > start)
+				hmlan_parse_one(start, eol - start, data);
+			start = eol + 1;
 		}
+
+		if (end - start > LAN_MAX_LINE_LENGTH) {
+			if (verbose)
+				printf("Client sent more than %d bytes without newline, closing connection!\n", LAN_MAX_LINE_LENGTH);
+			return -1;
+		}
+
+		/* Move the incomplete line (if any) to the front */
+		c->read_buflen = end - start;
+		if (c->read_buflen && (start != c->read_buf))
+			memmove(c->read_buf, start, c->read_buflen);
 	} else if (r < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return 1;
 		if (errno != ECONNRESET)
 			perror("read");
 		return r;
@@ -499,17 +845,146 @@ static int hmlan_parse_in(int fd, void *data)
 	return 1;
 }
 
-static int comm(int fd_in, int fd_out, int master_socket, int flags)
+static void lan_disconnect(int fd)
+{
+	shutdown(fd, SHUT_RDWR);
+	close(fd);
+}
+
+static int lan_accept(int sock, in_addr_t *addr)
+{
+	struct sockaddr_in csin;
+	socklen_t csinlen;
+	int client;
+
+	memset(&csin, 0, sizeof(csin));
+	csinlen = sizeof(csin);
+	client = accept(sock, (struct sockaddr*)&csin, &csinlen);
+	if (client == -1)
+		return -1;
+
+	/* FIXME: getnameinfo... */
+	*addr = ntohl(csin.sin_addr.s_addr);
+
+	return client;
+}
+
+static int client_add(struct hmcfgusb_dev *dev, int fd_in, int fd_out, int remote, in_addr_t addr)
+{
+	struct lan_client *c;
+
+	if (n_clients == max_clients)
+		return 0;
+
+	c = &(clients[n_clients]);
+	memset(c, 0, sizeof(struct lan_client));
+	c->fd_in = fd_in;
+	c->fd_out = fd_out;
+	c->remote = remote;
+	c->addr = addr;
+	c->events = POLLIN;
+
+	/* Never let a slow client block the USB callback */
+	if (remote && (max_clients > 1)) {
+		c->out_buf = malloc(LAN_CLIENT_QUEUE_LENGTH);
+		if (!c->out_buf) {
+			perror("malloc(out_buf)");
+			return 0;
+		}
+
+		if (fcntl(fd_in, F_SETFL, fcntl(fd_in, F_GETFL) | O_NONBLOCK) == -1) {
+			perror("fcntl(O_NONBLOCK)");
+			free(c->out_buf);
+			return 0;
+		}
+	}
+
+	if (!hmcfgusb_add_pfd(dev, fd_in, POLLIN)) {
+		fprintf(stderr, "Can't add client to pollfd!\n");
+		free(c->out_buf);
+		return 0;
+	}
+
+	n_clients++;
+	client_log(c, "Client %d.%d.%d.%d connected!\n");
+
+	if (persistent)
+		backlog_replay(c);
+
+	return 1;
+}
+
+static void client_del(struct hmcfgusb_dev *dev, int n)
+{
+	struct lan_client *c = &(clients[n]);
+
+	hmcfgusb_del_pfd(dev, c->fd_in);
+	if (c->remote)
+		lan_disconnect(c->fd_in);
+
+	if (verbose && c->dropped)
+		printf("%lu frames dropped for slow client\n", c->dropped);
+
+	client_log(c, "Connection to %d.%d.%d.%d closed!\n");
+
+	free(c->out_buf);
+
+	n_clients--;
+	if (n != n_clients)
+		memcpy(c, &(clients[n_clients]), sizeof(struct lan_client));
+}
+
+static struct lan_client *client_find(int fd)
+{
+	int i;
+
+	for (i = 0; i < n_clients; i++) {
+		if (clients[i].fd_in == fd)
+			return &(clients[i]);
+	}
+
+	return NULL;
+}
+
+static void clients_update(struct hmcfgusb_dev *dev)
+{
+	short events;
+	int i;
+
+	for (i = n_clients - 1; i >= 0; i--) {
+		struct lan_client *c = &(clients[i]);
+
+		if (c->closing) {
+			client_del(dev, i);
+			continue;
+		}
+
+		events = POLLIN;
+		if (c->out_len)
+			events |= POLLOUT;
+
+		if (events != c->events) {
+			hmcfgusb_mod_pfd(dev, c->fd_in, events);
+			c->events = events;
+		}
+	}
+}
+
+static int comm(int fd_in, int fd_out, in_addr_t addr, int master_socket, int flags)
 {
 	struct hmcfgusb_dev *dev;
 	uint8_t out[0x40]; //FIXME!!!
+	int remote = (master_socket >= 0);
+	int ret = 0;
 	int quit = 0;
 
 	hmcfgusb_set_debug(debug);
 
-	dev = hmcfgusb_init(hmlan_format_out, &fd_out, serial);
+	dev = hmcfgusb_init(hmlan_format_out, NULL, serial);
 	if (!dev) {
 		fprintf(stderr, "Can't initialize HM-CFG-USB!\n");
+		if (remote && (fd_in >= 0))
+			lan_disconnect(fd_in);
 		return 0;
 	}
 
@@ -520,10 +995,24 @@ static int comm(int fd_in, int fd_out, int master_socket, int flags)
 		hmcfgusb_leave_bootloader(dev);
 
 		hmcfgusb_close(dev);
+		if (remote && (fd_in >= 0))
+			lan_disconnect(fd_in);
 		sleep(1);
 		return 0;
 	}
 
+	cached_h_len = 0;
+	frame_ring_clear(&backlog);
+	frame_ring_clear(&held);
+
+	/* In persistent mode, clients are only accepted by the loop below */
+	if ((fd_in >= 0) && !client_add(dev, fd_in, fd_out, remote, addr)) {
+		hmcfgusb_close(dev);
+		if (remote)
+			lan_disconnect(fd_in);
+		return 0;
+	}
+
 	if ((reboot_at_hour != -1) && (reboot_at_minute != -1)) {
 		struct tm *tm_s;
 		time_t tm;
@@ -532,7 +1021,7 @@ static int comm(int fd_in, int fd_out, int master_socket, int flags)
 		tm_s = localtime(&tm);
 		if (tm_s == NULL) {
 			perror("localtime");
-			return 0;
+			goto out;
 		}
 
 		tm_s->tm_hour = reboot_at_hour;
@@ -549,43 +1038,59 @@ static int comm(int fd_in, int fd_out, int master_socket, int flags)
 	if (verbose && reboot_seconds)
 		printf("Rebooting in %u seconds\n", reboot_seconds);
 
-
-	if (!hmcfgusb_add_pfd(dev, fd_in, POLLIN)) {
-		fprintf(stderr, "Can't add client to pollfd!\n");
-		hmcfgusb_close(dev);
-		return 0;
-	}
-
 	if (master_socket >= 0) {
 		if (!hmcfgusb_add_pfd(dev, master_socket, POLLIN)) {
 			fprintf(stderr, "Can't add master_socket to pollfd!\n");
-			hmcfgusb_close(dev);
-			return 0;
+			goto out;
 		}
 	}
 
+	timerwheel_init(&timers);
+	timer_init(&keepalive_timer, keepalive_expired, dev);
+	timer_init(&handshake_timer, handshake_expired, dev);
+	timer_init(&reboot_timer, reboot_expired, dev);
+	timer_init(&stats_timer, stats_expired, NULL);
+
 	memset(out, 0, sizeof(out));
 	out[0] = 'K';
 	wait_for_h = 1;
 	hmcfgusb_send_null_frame(dev, 1);
-	hmcfgusb_send(dev, out, sizeof(out), 1);
+	hmcfgusb_send_async(dev, out, sizeof(out), 1, NULL, NULL);
+
+	keepalive_ms = POLL_TIMEOUT_MS;
+	timer_add(&timers, &keepalive_timer, keepalive_ms);
+	timer_add(&timers, &handshake_timer, HANDSHAKE_RETRY_MS);
+	schedule_reboot();
+
+	wakeups = 0;
+	timer_wakeups = 0;
+	if (verbose)
+		timer_add(&timers, &stats_timer, STATS_INTERVAL_MS);
 
 	while(!quit) {
 		int fd;
 
-		fd = hmcfgusb_poll(dev, POLL_TIMEOUT_MS);
+		/* Only wake up when there is something to do */
+		fd = hmcfgusb_poll(dev, timerwheel_next(&timers));
+		wakeups++;
 		if (fd >= 0) {
 			if (fd == master_socket) {
+				in_addr_t client_addr;
 				int client;
 
-				client = accept(master_socket, NULL, 0);
+				client = lan_accept(master_socket, &client_addr);
 				if (client >= 0) {
-					shutdown(client, SHUT_RDWR);
-					close(client);
+					if (!client_add(dev, client, client, 1, client_addr))
+						lan_disconnect(client);
 				}
 			} else {
-				if (hmlan_parse_in(fd, dev) <= 0) {
-					quit = 1;
+				struct lan_client *c = client_find(fd);
+
+				if (c) {
+					client_flush(c);
+					if (hmlan_parse_in(c, dev) <= 0) {
+						c->closing = 1;
+					}
 				}
 			}
 		} else if (fd == -1) {
@@ -594,28 +1099,34 @@ static int comm(int fd_in, int fd_out, int master_socket, int flags)
 					perror("hmcfgusb_poll");
 					quit = 1;
 				} else {
-					/* periodically wakeup the device */
-					hmcfgusb_send_null_frame(dev, 1);
-					if (wait_for_h) {
-						memset(out, 0, sizeof(out));
-						out[0] = 'K';
-						hmcfgusb_send(dev, out, sizeof(out), 1);
-					}
+					timer_wakeups++;
 				}
 			}
 		}
 
-		if (reboot_seconds && ((dev->opened_at + reboot_seconds) <= time(NULL))) {
-			if (verbose) {
-				printf("HM-CFG-USB running since %lu seconds, rebooting now...\n",
-					time(NULL) - dev->opened_at);
-			}
-			hmcfgusb_enter_bootloader(dev);
-		}
+		timerwheel_run(&timers);
+
+		clients_update(dev);
+		if ((!n_clients) && ((!persistent) || (!remote)))
+			quit = 1;
 	}
 
+	ret = 1;
+
+out:
+	while (n_clients)
+		client_del(dev, n_clients - 1);
+
+	if (verbose)
+		printf("USB: %lu frames received, %lu with no IN transfer armed\n", dev->in_frames, dev->in_dry);
+
+	timer_del(&keepalive_timer);
+	timer_del(&handshake_timer);
+	timer_del(&reboot_timer);
+	timer_del(&stats_timer);
+
 	hmcfgusb_close(dev);
-	return 1;
+	return ret;
 }
 
 void sigterm_handler(int sig)
@@ -629,6 +1140,19 @@ void sigterm_handler(int sig)
 #define FLAG_DAEMON	(1 << 0)
 #define FLAG_PID_FILE	(1 << 1)
 
+/* Must be called after daemonizing, the logger thread does not survive fork().
+ * Without -L, -v or -D nothing is logged and no thread is needed. */
+static void start_logger(void)
+{
+	if ((!logfile) && (!verbose) && (!debug))
+		return;
+
+	logger_init(logfile, verbose ? LOGGER_STDOUT : 0);
+	atexit(logger_exit);
+
+	hmcfgusb_set_dump(logger_hexdump);
+}
+
 static int socket_server(char *iface, int port, int flags)
 {
 	struct sigaction sact;
@@ -701,6 +1225,8 @@ static int socket_server(char *iface, int port, int flags)
 			fclose(pidfile);
 	}
 
+	start_logger();
+
 	memset(&sact, 0, sizeof(sact));
 	sact.sa_handler = SIG_IGN;
 
@@ -738,49 +1264,29 @@ static int socket_server(char *iface, int port, int flags)
 		return EXIT_FAILURE;
 	}
 
-	if (listen(sock, 1) == -1) {
+	if (listen(sock, max_clients) == -1) {
 		perror("Can't listen on socket");
 		return EXIT_FAILURE;
 	}
 
 	while(1) {
-		struct sockaddr_in csin;
-		socklen_t csinlen;
-		int client;
 		in_addr_t client_addr;
+		int client;
 
-		memset(&csin, 0, sizeof(csin));
-		csinlen = sizeof(csin);
-		client = accept(sock, (struct sockaddr*)&csin, &csinlen);
+		if (persistent) {
+			comm(-1, -1, 0, sock, flags);
+			sleep(1);
+			continue;
+		}
+
+		client = lan_accept(sock, &client_addr);
 		if (client == -1) {
 			perror("Couldn't accept client");
 			continue;
 		}
 
-		/* FIXME: getnameinfo... */
-		client_addr = ntohl(csin.sin_addr.s_addr);
-
-		write_log(NULL, 0, "Client %d.%d.%d.%d connected!\n",
-				(client_addr & 0xff000000) >> 24,
-				(client_addr & 0x00ff0000) >> 16,
-				(client_addr & 0x0000ff00) >> 8,
-				(client_addr & 0x000000ff));
-
-		comm(client, client, sock, flags);
-
-		shutdown(client, SHUT_RDWR);
-		close(client);
-
-		if (lan_read_buf)
-			free(lan_read_buf);
-		lan_read_buf = NULL;
-		lan_read_buflen = 0;
+		comm(client, client, client_addr, sock, flags);
 
-		write_log(NULL, 0, "Connection to %d.%d.%d.%d closed!\n",
-				(client_addr & 0xff000000) >> 24,
-				(client_addr & 0x00ff0000) >> 16,
-				(client_addr & 0x0000ff00) >> 8,
-				(client_addr & 0x000000ff));
 		sleep(1);
 	}
 
@@ -789,7 +1295,9 @@ static int socket_server(char *iface, int port, int flags)
 
 static int interactive_server(int flags)
 {
-	if (!comm(STDIN_FILENO, STDOUT_FILENO, -1, flags))
+	start_logger();
+
+	if (!comm(STDIN_FILENO, STDOUT_FILENO, 0, -1, flags))
 		return EXIT_FAILURE;
 
 	return EXIT_SUCCESS;
@@ -804,13 +1312,18 @@ void hmlan_syntax(char *prog)
 	fprintf(stderr, "\t-h\t\tthis help\n");
 	fprintf(stderr, "\t-I\t\tpretend to be HM-LAN-IF for compatibility with client-software (previous default)\n");
 	fprintf(stderr, "\t-i\t\tinteractive mode (connect HM-CFG-USB to terminal)\n");
+	fprintf(stderr, "\t-k\t\tkeep HM-CFG-USB open while no client is connected\n");
 	fprintf(stderr, "\t-l ip\t\tlisten on given IP address only (for example 127.0.0.1)\n");
 	fprintf(stderr, "\t-L logfile\tlog network-communication to logfile\n");
+	fprintf(stderr, "\t-m n\t\tserve up to n clients simultaneously (default: %u)\n", DEFAULT_MAX_CLIENTS);
+	fprintf(stderr, "\t-o policy\twhat to do with slow clients when using -m: drop (oldest frames, default) or disconnect\n");
 	fprintf(stderr, "\t-P\t\tcreate PID file " PID_FILE " in daemon mode\n");
 	fprintf(stderr, "\t-p n\t\tlisten on port n (default: 1000)\n");
+	fprintf(stderr, "\t-q policy\twhat to do when more than %d frames arrive during the handshake: drop-oldest (default) or drop-newest\n", LAN_HOLD_FRAMES);
 	fprintf(stderr, "\t-r n\t\treboot HM-CFG-USB after n seconds (0: no reboot, default: %u if FW < 0.967, 0 otherwise)\n", DEFAULT_REBOOT_SECONDS);
 	fprintf(stderr, "\t   hh:mm\treboot HM-CFG-USB daily at hh:mm\n");
 	fprintf(stderr, "\t-S serial\tuse HM-CFG-USB with given serial (for multiple hmland instances)\n");
+	fprintf(stderr, "\t-u n\t\tkeep n USB IN transfers submitted (default: 4)\n");
 	fprintf(stderr, "\t-v\t\tverbose mode\n");
 	fprintf(stderr, "\t-V\t\tshow version (" VERSION ")\n");
 
@@ -825,7 +1338,7 @@ int main(int argc, char **argv)
 	char *ep;
 	int opt;
 	
-	while((opt = getopt(argc, argv, "DdhIiPp:Rr:l:L:S:vV")) != -1) {
+	while((opt = getopt(argc, argv, "DdhIikPp:q:Rr:l:L:m:o:S:u:vV")) != -1) {
 		switch (opt) {
 			case 'D':
 				debug = 1;
@@ -840,6 +1353,9 @@ int main(int argc, char **argv)
 			case 'i':
 				interactive = 1;
 				break;
+			case 'k':
+				persistent = 1;
+				break;
 			case 'P':
 				flags |= FLAG_PID_FILE;
 				break;
@@ -883,9 +1399,42 @@ int main(int argc, char **argv)
 					exit(EXIT_FAILURE);
 				}
 				break;
+			case 'm':
+				max_clients = strtoul(optarg, &ep, 10);
+				if ((*ep != '\0') || (max_clients < 1)) {
+					fprintf(stderr, "Can't parse number of clients!\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'o':
+				if (!strcmp(optarg, "drop")) {
+					slow_client_policy = SLOW_CLIENT_DROP_OLDEST;
+				} else if (!strcmp(optarg, "disconnect")) {
+					slow_client_policy = SLOW_CLIENT_DISCONNECT;
+				} else {
+					fprintf(stderr, "Unknown slow client policy: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'q':
+				if (!strcmp(optarg, "drop-oldest")) {
+					held.policy = FRAME_DROP_OLDEST;
+				} else if (!strcmp(optarg, "drop-newest")) {
+					held.policy = FRAME_DROP_NEWEST;
+				} else {
+					fprintf(stderr, "Unknown queue overflow policy: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'S':
 				serial = optarg;
 				break;
+			case 'u':
+				if ((!hmcfgusb_set_in_transfers(strtoul(optarg, &ep, 10))) || (*ep != '\0')) {
+					fprintf(stderr, "Can't parse number of USB IN transfers!\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -902,6 +1451,12 @@ int main(int argc, char **argv)
 				break;
 		}
 	}
+
+	clients = malloc(sizeof(struct lan_client) * max_clients);
+	if (!clients) {
+		perror("malloc(clients)");
+		exit(EXIT_FAILURE);
+	}
 	
 	if (interactive) {
 		return interactive_server(flags);
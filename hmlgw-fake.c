@@ -0,0 +1,420 @@
+/* Minimal fake HM-LGW-O-TW-W-EU for testing the LAN gateway transport
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "version.h"
+#include "hexdump.h"
+#include "crc16.h"
+#include "serial.h"
+#include "hmuartlgw.h"
+
+/* Captured from a HM-LGW-O-TW-W-EU with firmware 1.1.5 */
+#define HMLGW_FAKE_HELLO	"H00,01,eQ3-HM-LGW,1.1.5,NEQ0000000\r\n"
+#define HMLGW_FAKE_DATA		"S00,BidCoS-over-LAN\r\n"
+#define HMLGW_FAKE_KEEPALIVE	"S00,SysCom-over-LAN\r\n"
+
+#define HMLGW_FAKE_BUFSIZE	(HMUARTLGW_MAX_FRAME * 2)
+
+struct fake_conn {
+	int fd;
+	int keepalive;
+	uint8_t buf[HMLGW_FAKE_BUFSIZE];
+	int pos;
+};
+
+static int verbose = 0;
+
+static int fake_write(struct fake_conn *conn, const void *buf, int len)
+{
+	int ret;
+
+	ret = write(conn->fd, buf, len);
+	if (ret != len) {
+		perror("write");
+		return 0;
+	}
+
+	return 1;
+}
+
+static int fake_escape(uint8_t *out, uint8_t *in, int len)
+{
+	int outpos = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if ((in[i] == 0xfc) || (in[i] == 0xfd)) {
+			out[outpos++] = 0xfc;
+			out[outpos++] = in[i] & 0x7f;
+		} else {
+			out[outpos++] = in[i];
+		}
+	}
+
+	return outpos;
+}
+
+static int fake_send_frame(struct fake_conn *conn, uint8_t dst, uint8_t cnt, uint8_t *cmd, int cmdlen)
+{
+	uint8_t frame[64];
+	uint8_t frame_esc[1 + sizeof(frame) * 2];
+	uint16_t crc;
+	int len;
+
+	if ((cmdlen + 7) > (int)sizeof(frame))
+		return 0;
+
+	frame[0] = 0xfd;
+	frame[1] = ((cmdlen + 2) >> 8) & 0xff;
+	frame[2] = (cmdlen + 2) & 0xff;
+	frame[3] = dst;
+	frame[4] = cnt;
+	memcpy(frame + 5, cmd, cmdlen);
+	crc = crc16(CRC16_INIT, frame, cmdlen + 5);
+	frame[cmdlen + 5] = (crc >> 8) & 0xff;
+	frame[cmdlen + 6] = crc & 0xff;
+
+	if (verbose)
+		hexdump(frame, cmdlen + 7, "LGW < ");
+
+	/* The start of frame is never escaped */
+	frame_esc[0] = frame[0];
+	len = 1 + fake_escape(frame_esc + 1, frame + 1, cmdlen + 6);
+
+	return fake_write(conn, frame_esc, len);
+}
+
+/* Answer like the coprocessor would, the application is always running */
+static int fake_handle_frame(struct fake_conn *conn, uint8_t *frame, int len)
+{
+	uint8_t ack[16];
+	int acklen = 0;
+	uint8_t dst = frame[3];
+	uint8_t cnt = frame[4];
+
+	if (verbose)
+		hexdump(frame, len, "LGW > ");
+
+	if (crc16(CRC16_INIT, frame, len) != 0) {
+		fprintf(stderr, "Invalid checksum on frame from client!\n");
+		return 1;
+	}
+
+	if (len < 8)
+		return 1;
+
+	switch (dst) {
+		case HMUARTLGW_OS:
+			ack[acklen++] = HMUARTLGW_OS_ACK;
+			if (frame[5] == HMUARTLGW_OS_GET_APP) {
+				ack[acklen++] = 0x02;
+				memcpy(ack + acklen, "Co_CPU_App", 10);
+				acklen += 10;
+			} else {
+				ack[acklen++] = 0x01;
+			}
+			break;
+		case HMUARTLGW_APP:
+			ack[acklen++] = HMUARTLGW_APP_ACK;
+			ack[acklen++] = 0x01;
+			break;
+		default:
+			return 1;
+	}
+
+	return fake_send_frame(conn, dst, cnt, ack, acklen);
+}
+
+static int fake_handle_line(struct fake_conn *conn, char *line)
+{
+	char reply[32];
+
+	printf("%s > %s\n", conn->keepalive ? "KA" : "DATA", line);
+
+	if (conn->keepalive && (line[0] == 'K')) {
+		snprintf(reply, sizeof(reply), ">%s\r\n", line);
+		return fake_write(conn, reply, strlen(reply));
+	}
+
+	return 1;
+}
+
+/* Unescape one complete frame from the start of the buffer, returns
+ * the number of consumed bytes or 0 if more input is needed */
+static int fake_unescape_frame(struct fake_conn *conn, uint8_t *frame, int *frame_len)
+{
+	int pos = 1;
+	int len = 1;
+	int want = HMUARTLGW_MAX_FRAME;
+
+	frame[0] = conn->buf[0];
+	while ((pos < conn->pos) && (len < want)) {
+		if (conn->buf[pos] == 0xfc) {
+			if ((pos + 1) >= conn->pos)
+				return 0;
+			frame[len++] = conn->buf[pos + 1] | 0x80;
+			pos += 2;
+		} else {
+			frame[len++] = conn->buf[pos++];
+		}
+
+		if (len == 3) {
+			want = 3 + ((frame[1] << 8) | frame[2]) + 2;
+			if (want > HMUARTLGW_MAX_FRAME)
+				want = HMUARTLGW_MAX_FRAME;
+		}
+	}
+
+	if (len < want)
+		return 0;
+
+	*frame_len = len;
+	return pos;
+}
+
+static int fake_input(struct fake_conn *conn)
+{
+	uint8_t frame[HMUARTLGW_MAX_FRAME];
+	int frame_len;
+	uint8_t *nl;
+	int consumed;
+	int ret;
+
+	ret = read(conn->fd, conn->buf + conn->pos, sizeof(conn->buf) - conn->pos);
+	if (ret <= 0)
+		return 0;
+	conn->pos += ret;
+
+	while (conn->pos) {
+		if (conn->buf[0] == 0xfd) {
+			consumed = fake_unescape_frame(conn, frame, &frame_len);
+			if (!consumed)
+				break;
+			if (!fake_handle_frame(conn, frame, frame_len))
+				return 0;
+		} else {
+			nl = memchr(conn->buf, '\n', conn->pos);
+			if (!nl)
+				break;
+			consumed = nl - conn->buf + 1;
+			*nl = 0;
+			if ((nl > conn->buf) && (*(nl - 1) == '\r'))
+				*(nl - 1) = 0;
+			if (!fake_handle_line(conn, (char*)conn->buf))
+				return 0;
+		}
+
+		memmove(conn->buf, conn->buf + consumed, conn->pos - consumed);
+		conn->pos -= consumed;
+	}
+
+	if (conn->pos == sizeof(conn->buf)) {
+		fprintf(stderr, "Garbage from client, dropping buffer\n");
+		conn->pos = 0;
+	}
+
+	return 1;
+}
+
+static int fake_listen(struct in_addr *addr, int port)
+{
+	struct sockaddr_in sin;
+	int sock;
+	int n = 1;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n)) == -1) {
+		perror("setsockopt(SO_REUSEADDR)");
+		close(sock);
+		return -1;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr = *addr;
+
+	if (bind(sock, (struct sockaddr*)&sin, sizeof(sin)) == -1) {
+		perror("bind");
+		close(sock);
+		return -1;
+	}
+
+	if (listen(sock, 1) == -1) {
+		perror("listen");
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static void fake_accept(int listen_fd, struct fake_conn *conn)
+{
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1) {
+		perror("accept");
+		return;
+	}
+
+	if (conn->fd != -1) {
+		fprintf(stderr, "Replacing existing %s connection\n", conn->keepalive ? "keepalive" : "data");
+		close(conn->fd);
+	}
+
+	conn->fd = fd;
+	conn->pos = 0;
+	printf("%s connection accepted\n", conn->keepalive ? "Keepalive" : "Data");
+
+	if (!fake_write(conn, HMLGW_FAKE_HELLO, strlen(HMLGW_FAKE_HELLO)) ||
+	    !fake_write(conn, conn->keepalive ? HMLGW_FAKE_KEEPALIVE : HMLGW_FAKE_DATA,
+	                strlen(conn->keepalive ? HMLGW_FAKE_KEEPALIVE : HMLGW_FAKE_DATA))) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+}
+
+static void hmlgw_fake_syntax(char *prog)
+{
+	fprintf(stderr, "Syntax: %s options\n\n", prog);
+	fprintf(stderr, "Possible options:\n");
+	fprintf(stderr, "\t-l ip\t\tbind to this address (default: 127.0.0.1)\n");
+	fprintf(stderr, "\t-p port\t\tdata port, keepalive is port+1 (default: 2000)\n");
+	fprintf(stderr, "\t-v\t\tdump all frames\n");
+	fprintf(stderr, "\t-V\t\tshow version (" VERSION ")\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct in_addr addr;
+	struct fake_conn conns[2];
+	struct pollfd pfds[4];
+	int listen_fd[2];
+	int port = 2000;
+	int opt;
+	int i;
+
+	addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	while((opt = getopt(argc, argv, "l:p:vVh")) != -1) {
+		switch (opt) {
+			case 'l':
+				if (inet_aton(optarg, &addr) == 0) {
+					fprintf(stderr, "Invalid IP address: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				port = atoi(optarg);
+				if ((port < 1) || (port > 65534)) {
+					fprintf(stderr, "Invalid port: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'V':
+				printf("hmlgw-fake " VERSION "\n");
+				printf("Copyright (c) 2013-16 Michael Gernoth\n\n");
+				exit(EXIT_SUCCESS);
+			case 'h':
+			case ':':
+			case '?':
+			default:
+				hmlgw_fake_syntax(argv[0]);
+				exit(EXIT_FAILURE);
+				break;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	crc16_init();
+
+	for (i = 0; i < 2; i++) {
+		listen_fd[i] = fake_listen(&addr, port + i);
+		if (listen_fd[i] == -1)
+			exit(EXIT_FAILURE);
+
+		memset(&conns[i], 0, sizeof(conns[i]));
+		conns[i].fd = -1;
+		conns[i].keepalive = i;
+	}
+
+	printf("Fake LAN gateway listening on %s:%d/%d\n", inet_ntoa(addr), port, port + 1);
+
+	while (1) {
+		for (i = 0; i < 2; i++) {
+			pfds[i].fd = listen_fd[i];
+			pfds[i].events = POLLIN;
+			pfds[i + 2].fd = conns[i].fd;
+			pfds[i + 2].events = POLLIN;
+		}
+
+		if (poll(pfds, 4, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < 2; i++) {
+			if (pfds[i].revents & POLLIN)
+				fake_accept(listen_fd[i], &conns[i]);
+
+			if ((pfds[i + 2].fd != -1) &&
+			    (pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) &&
+			    (pfds[i + 2].fd == conns[i].fd)) {
+				if (!fake_input(&conns[i])) {
+					printf("%s connection closed\n", conns[i].keepalive ? "Keepalive" : "Data");
+					close(conns[i].fd);
+					conns[i].fd = -1;
+				}
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -36,6 +36,8 @@
 #include "version.h"
 #include "hexdump.h"
 #include "hmcfgusb.h"
+#include "util.h"
+#include "serial.h"
 #include "hmuartlgw.h"
 #include "hm.h"
 
@@ -124,8 +126,12 @@ static void dissect_hm(uint8_t *buf, int len)
 	struct timeval tv;
 	struct tm *tmp;
 	char ts[32];
+	char hex[512];
 	static int count = 0;
-	int i;
+	int hexlen;
+
+	if (len > (int)(sizeof(hex) / 2))
+		len = sizeof(hex) / 2;
 
 	gettimeofday(&tv, NULL);
 	tmp = localtime(&tv.tv_sec);
@@ -135,10 +141,8 @@ static void dissect_hm(uint8_t *buf, int len)
 	if (verbose) {
 		printf("%s.%06ld: ", ts, tv.tv_usec);
 
-		for (i = 0; i < len; i++) {
-			printf("%02X", buf[i]);
-		}
-		printf("\n");
+		hexlen = hex_encode(hex, buf, len);
+		printf("%.*s\n", hexlen, hex);
 		printf("Packet information:\n");
 		printf("\tLength: %u\n", buf[0]);
 		printf("\tMessage ID: %u\n", buf[1]);
@@ -156,11 +160,8 @@ static void dissect_hm(uint8_t *buf, int len)
 		if (buf[2] & (1 << 7)) printf("RPTEN ");
 		printf("\n");
 		printf("\tMessage type: %s (0x%02x 0x%02x)\n", hm_message_types(buf[3], buf[10]), buf[3], buf[10]);
-		printf("\tMessage: ");
-		for (i = 10; i < len; i++) {
-			printf("%02X", buf[i]);
-		}
-		printf("\n");
+		hexlen = (len > 10) ? hex_encode(hex, buf + 10, len - 10) : 0;
+		printf("\tMessage: %.*s\n", hexlen, hex);
 
 		printf("\n");
 	} else {
@@ -173,10 +174,8 @@ static void dissect_hm(uint8_t *buf, int len)
 				buf[4], buf[5], buf[6],
 				buf[7], buf[8], buf[9]);
 
-		for (i = 10; i < len; i++) {
-			printf("%02X", buf[i]);
-		}
-		printf("%s(%s)\n", (i>10)?" ":"", hm_message_types(buf[3], buf[10]));
+		hexlen = (len > 10) ? hex_encode(hex, buf + 10, len - 10) : 0;
+		printf("%.*s%s(%s)\n", hexlen, hex, hexlen ? " " : "", hm_message_types(buf[3], buf[10]));
 	}
 }
 
@@ -242,6 +241,13 @@ static int parse_hmuartlgw(enum hmuartlgw_dst dst, uint8_t *buf, int buf_len, vo
 	return 1;
 }
 
+static void set_hmid_done(struct hmuartlgw_dev *dev, enum hmuartlgw_dst dst, uint8_t *buf, int buf_len, void *data)
+{
+	int *done = data;
+
+	*done = 1;
+}
+
 void hmsniff_syntax(char *prog)
 {
 	fprintf(stderr, "Syntax: %s options\n\n", prog);
@@ -249,8 +255,13 @@ void hmsniff_syntax(char *prog)
 	fprintf(stderr, "\t-f\t\tfast (100k/firmware update) mode\n");
 	fprintf(stderr, "\t-S serial\tuse HM-CFG-USB with given serial\n");
 	fprintf(stderr, "\t-U device\tuse HM-MOD-UART on given device\n");
+	fprintf(stderr, "\t-L host[:port]\tuse HM-LGW-O-TW-W-EU at given address\n");
+	fprintf(stderr, "\t-P count\tmeasure the round trip of \"count\" queries after opening\n");
 	fprintf(stderr, "\t-v\t\tverbose mode\n");
 	fprintf(stderr, "\t-V\t\tshow version (" VERSION ")\n");
+	fprintf(stderr, "\nSerial options for HM-MOD-UART:\n");
+	fprintf(stderr, "\t-b bps\t\tuse speed \"bps\" (default: %d)\n", HMUARTLGW_SPEED);
+	serial_opts_syntax();
 
 }
 
@@ -258,17 +269,31 @@ int main(int argc, char **argv)
 {
 	struct hm_dev dev = { 0 };
 	struct recv_data rdata;
+	struct serial_opts sopts;
 	char *serial = NULL;
+	char *endptr = NULL;
 	char *uart = NULL;
+	char *lgw = NULL;
+	int hmid_set;
 	int quit = 0;
 	int speed = 10;
+	int probes = 0;
 	uint8_t buf[32];
 	int opt;
 
 	dev.type = DEVICE_TYPE_HMCFGUSB;
+	serial_opts_init(&sopts, HMUARTLGW_SPEED);
 
-	while((opt = getopt(argc, argv, "fS:U:vV")) != -1) {
+	while((opt = getopt(argc, argv, "b:fL:P:S:U:vV" SERIAL_GETOPT)) != -1) {
 		switch (opt) {
+			case 'b':
+				sopts.speed = strtoul(optarg, &endptr, 10);
+				if ((*endptr != '\0') || (!sopts.speed)) {
+					fprintf(stderr, "Invalid speed!\n\n");
+					hmsniff_syntax(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'f':
 				speed = 100;
 				break;
@@ -279,6 +304,23 @@ int main(int argc, char **argv)
 				uart = optarg;
 				dev.type = DEVICE_TYPE_HMUARTLGW;
 				break;
+			case 'L':
+				lgw = optarg;
+				dev.type = DEVICE_TYPE_HMUARTLGW;
+				break;
+			case 'P':
+				probes = atoi(optarg);
+				break;
+			case 'm':
+			case 'n':
+			case 'r':
+			case 't':
+				if (!serial_opts_getopt(&sopts, opt, optarg)) {
+					fprintf(stderr, "Invalid value for -%c!\n\n", opt);
+					hmsniff_syntax(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -323,19 +365,32 @@ int main(int argc, char **argv)
 			buf[1] = speed;
 			hmcfgusb_send(dev.hmcfgusb, buf, 2, 1);
 		} else {
-			dev.hmuartlgw = hmuart_init(uart, parse_hmuartlgw, &rdata, 1);
+			if (lgw) {
+				dev.hmuartlgw = hmlgw_init(lgw, parse_hmuartlgw, &rdata);
+			} else {
+				dev.hmuartlgw = hmuart_init_opts(uart, &sopts, parse_hmuartlgw, &rdata, 1);
+			}
 			if (!dev.hmuartlgw) {
 				fprintf(stderr, "Can't initialize HM-MOD-UART!\n");
 				exit(1);
 			}
 			printf("HM-MOD-UART opened!\n");
 
+			if (probes > 0) {
+				struct serial_latency lat;
+
+				memset(&lat, 0, sizeof(lat));
+				hmuartlgw_probe_latency(dev.hmuartlgw, probes, &lat);
+				serial_latency_print("HM-MOD-UART", &lat);
+			}
+
 			buf[0] = HMUARTLGW_APP_SET_HMID;
 			buf[1] = 0x00;
 			buf[2] = 0x00;
 			buf[3] = 0x00;
-			hmuartlgw_send(dev.hmuartlgw, buf, 4, HMUARTLGW_APP);
-			do { hmuartlgw_poll(dev.hmuartlgw, 500); } while (errno != ETIMEDOUT);
+			hmid_set = 0;
+			hmuartlgw_send_req(dev.hmuartlgw, buf, 4, HMUARTLGW_APP, 500, set_hmid_done, &hmid_set);
+			do { hmuartlgw_poll(dev.hmuartlgw, 500); } while ((!hmid_set) && (errno != ETIMEDOUT));
 			if (speed == 100) {
 				buf[0] = HMUARTLGW_OS_UPDATE_MODE;
 				buf[1] = 0xe9;
@@ -396,9 +451,5 @@ int main(int argc, char **argv)
 		}
 	} while (!quit);
 
-	if (dev.type == DEVICE_TYPE_HMCFGUSB) {
-		hmcfgusb_exit();
-	}
-
 	return EXIT_SUCCESS;
 }
@@ -24,6 +24,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -31,17 +34,32 @@
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "crc16.h"
 #include "hexdump.h"
+#include "reactor.h"
+#include "serial.h"
 #include "hmuartlgw.h"
 
 #define HMUARTLGW_INIT_TIMEOUT	10000
 
-#define HMUARTLGW_SETTLE_TIME	1
+#define HMUARTLGW_PROBE_DELAY	10	/* ms, doubled up to HMUARTLGW_PROBE_DELAY_MAX */
+#define HMUARTLGW_PROBE_DELAY_MAX	160
+#define HMUARTLGW_PROBE_TIMEOUT	1000	/* ms, unanswered probes double up to this from HMUARTLGW_PROBE_DELAY */
+#define HMUARTLGW_FLUSH_QUIET	10	/* ms without data until the line counts as drained */
 
-static int debug = 0;
+#define HMLGW_PORT		2000	/* keepalive channel is on the next port */
+#define HMLGW_CONNECT_TIMEOUT	5000
+#define HMLGW_WRITE_TIMEOUT	5000
+#define HMLGW_KEEPALIVE_INTERVAL	5	/* s */
+#define HMLGW_KEEPALIVE_MISSED	3	/* unanswered keepalives until we give up */
+
+static int debug = 0;	/* default for devices opened afterwards */
 
 enum hmuartlgw_state {
 	HMUARTLGW_QUERY_APPSTATE,
@@ -59,35 +77,15 @@ struct recv_data {
 	struct hmuartlgw_dev *dev;
 };
 
-
-#define CRC16_POLY	0x8005
-
-static uint16_t crc16(uint8_t* buf, int length)
-{
-	uint16_t crc = 0xd77f;
-	int i;
-
-	while (length--) {
-		crc ^= *buf++ << 8;
-		for (i = 0; i < 8; i++) {
-			if (crc & 0x8000) {
-				crc <<= 1;
-				crc ^= CRC16_POLY;
-			} else {
-				crc <<= 1;
-			}
-		}
-	}
-
-	return crc;
-}
+static void hmuartlgw_rx(struct hmuartlgw_dev *dev, uint8_t *data, int len);
+static int hmuartlgw_writev(int fd, struct iovec *iov, int iovcnt);
 
 static int hmuartlgw_init_parse(enum hmuartlgw_dst dst, uint8_t *buf, int buf_len, void *data)
 {
 	struct recv_data *rdata = data;
 
 #if 0
-	if (debug) {
+	if (rdata->dev->debug) {
 		printf("Length: %d\n", buf_len);
 		hexdump(buf, buf_len, "INIT > ");
 	}
@@ -132,7 +130,7 @@ static int hmuartlgw_init_parse(enum hmuartlgw_dst dst, uint8_t *buf, int buf_le
 
 		switch(rdata->state) {
 			case HMUARTLGW_QUERY_APPSTATE:
-				if (debug) {
+				if (rdata->dev->debug) {
 					printf("Re-sending appstate-query for new firmare\n");
 				}
 
@@ -140,7 +138,7 @@ static int hmuartlgw_init_parse(enum hmuartlgw_dst dst, uint8_t *buf, int buf_le
 				hmuartlgw_send(rdata->dev, buf, 1, HMUARTLGW_DUAL);
 				break;
 			case HMUARTLGW_ENTER_BOOTLOADER:
-				if (debug) {
+				if (rdata->dev->debug) {
 					printf("Re-sending switch to bootloader for new firmare\n");
 				}
 
@@ -208,9 +206,17 @@ static int hmuartlgw_init_parse(enum hmuartlgw_dst dst, uint8_t *buf, int buf_le
 }
 
 struct hmuartlgw_dev *hmuart_init(char *device, hmuartlgw_cb_fn cb, void *data, int app)
+{
+	struct serial_opts opts;
+
+	serial_opts_init(&opts, HMUARTLGW_SPEED);
+
+	return hmuart_init_opts(device, &opts, cb, data, app);
+}
+
+struct hmuartlgw_dev *hmuart_init_opts(char *device, struct serial_opts *opts, hmuartlgw_cb_fn cb, void *data, int app)
 {
 	struct hmuartlgw_dev *dev = NULL;
-	struct termios oldtio, tio;
 
 	dev = malloc(sizeof(struct hmuartlgw_dev));
 	if (dev == NULL) {
@@ -219,38 +225,32 @@ struct hmuartlgw_dev *hmuart_init(char *device, hmuartlgw_cb_fn cb, void *data,
 	}
 
 	memset(dev, 0, sizeof(struct hmuartlgw_dev));
+	dev->debug = debug;
+	dev->ka_fd = -1;
+	dev->ka_timer = -1;
+
+	crc16_init();
 
-	dev->fd = open(device, O_RDWR | O_NOCTTY);
-	if (dev->fd < 0) {
-		perror("open(hmuartlgw)");
+	opts->canonical = 0;
+	dev->fd = serial_open(device, opts);
+	if (dev->fd < 0)
 		goto out;
-	}
 
-	if (debug) {
-		fprintf(stderr, "%s opened\n", device);
-	}
+	dev->read_chunk = opts->read_chunk;
+	if (dev->read_chunk > (int)sizeof(dev->rx))
+		dev->read_chunk = sizeof(dev->rx);
 
-	if (tcgetattr(dev->fd, &oldtio) == -1) {
-		perror("tcgetattr");
-		goto out2;
+	if (dev->debug) {
+		fprintf(stderr, "%s opened with %u bps, VMIN %d, VTIME %d, low latency %s, %d byte reads\n",
+			device, opts->speed, opts->vmin, opts->vtime,
+			opts->low_latency ? "on" : "off", dev->read_chunk);
 	}
 
-	memset(&tio, 0, sizeof(tio));
-
-	tio.c_cflag = B115200 | CS8 | CLOCAL | CREAD;
-	tio.c_iflag = IGNPAR;
-	tio.c_oflag = 0;
-	tio.c_lflag = 0;
-	tio.c_cc[VTIME] = 0;
-	tio.c_cc[VMIN] = 1;
-
-	tcflush(dev->fd, TCIFLUSH);
-	if (tcsetattr(dev->fd, TCSANOW, &tio) == -1) {
-		perror("tcsetattr");
+	dev->reactor = reactor_init();
+	if ((!dev->reactor) || (!reactor_add(dev->reactor, dev->fd, POLLIN, dev)))
 		goto out2;
-	}
 
-	if (debug) {
+	if (dev->debug) {
 		fprintf(stderr, "serial parameters set\n");
 	}
 
@@ -268,17 +268,445 @@ struct hmuartlgw_dev *hmuart_init(char *device, hmuartlgw_cb_fn cb, void *data,
 	return dev;
 
 out2:
+	reactor_close(dev->reactor);
 	close(dev->fd);
 out:
 	free(dev);
 	return NULL;
 }
 
+/* Connect without blocking longer than HMLGW_CONNECT_TIMEOUT, the socket stays non-blocking */
+static int hmlgw_connect(char *host, int port)
+{
+	struct addrinfo hints, *res, *ai;
+	struct pollfd pfd;
+	char service[8];
+	socklen_t len;
+	int one = 1;
+	int fd = -1;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+
+	err = getaddrinfo(host, service, &hints, &res);
+	if (err) {
+		fprintf(stderr, "Can't resolve %s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+
+		if (errno == EINPROGRESS) {
+			memset(&pfd, 0, sizeof(pfd));
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+
+			err = ETIMEDOUT;
+			if (poll(&pfd, 1, HMLGW_CONNECT_TIMEOUT) == 1) {
+				len = sizeof(err);
+				if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+					err = errno;
+			}
+
+			if (!err)
+				break;
+			errno = err;
+		}
+
+		fprintf(stderr, "Can't connect to %s:%d: %s\n", host, port, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	/* Frames are small and latency matters */
+	if ((fd >= 0) && (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1))
+		perror("setsockopt(TCP_NODELAY)");
+
+	return fd;
+}
+
+/* Take one CR/LF terminated line from buf, returns its length or -1 if there is none */
+static int hmlgw_next_line(uint8_t *buf, int *pos, char *line, int line_len)
+{
+	uint8_t *eol;
+	int len;
+
+	eol = memchr(buf, '\n', *pos);
+	if (!eol)
+		return -1;
+
+	len = eol - buf;
+	if ((len > 0) && (buf[len - 1] == '\r'))
+		len--;
+	if (len >= line_len)
+		len = line_len - 1;
+
+	memcpy(line, buf, len);
+	line[len] = '\0';
+
+	*pos -= (eol - buf) + 1;
+	memmove(buf, eol + 1, *pos);
+
+	return len;
+}
+
+/* Wait for the next line, anything after it stays in buf */
+static int hmlgw_getline(int fd, uint8_t *buf, int *pos, int size, char *line, int line_len)
+{
+	struct pollfd pfd;
+	int len;
+	int r;
+
+	while ((len = hmlgw_next_line(buf, pos, line, line_len)) < 0) {
+		if (*pos == size) {
+			fprintf(stderr, "Line from LAN gateway too long!\n");
+			return -1;
+		}
+
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+
+		if (poll(&pfd, 1, HMLGW_CONNECT_TIMEOUT) != 1) {
+			fprintf(stderr, "Timeout waiting for LAN gateway!\n");
+			return -1;
+		}
+
+		r = read(fd, buf + *pos, size - *pos);
+		if (r < 0) {
+			if (errno == EAGAIN)
+				continue;
+			perror("read(hmlgw)");
+			return -1;
+		} else if (r == 0) {
+			fprintf(stderr, "LAN gateway closed the connection!\n");
+			return -1;
+		}
+
+		*pos += r;
+	}
+
+	return len;
+}
+
+static int hmlgw_write_line(int fd, char *line)
+{
+	struct iovec iov[1];
+
+	iov[0].iov_base = line;
+	iov[0].iov_len = strlen(line);
+
+	return hmuartlgw_writev(fd, iov, 1);
+}
+
+/* Both channels greet with "H<cnt>,01,<type>,<version>,<serial>" and
+ * "S<cnt>,<channel>", the latter is acknowledged with ">cnt,0000".
+ * A "V" line asks for the LAN key, which we don't support. */
+static int hmlgw_handshake(struct hmuartlgw_dev *dev, int fd, uint8_t *buf, int *pos, int size, char *channel, uint8_t *cnt)
+{
+	char line[128];
+	char ack[16];
+	unsigned int c;
+
+	while (1) {
+		if (hmlgw_getline(fd, buf, pos, size, line, sizeof(line)) < 0)
+			return 0;
+
+		if (dev->debug)
+			fprintf(stderr, "LGW > %s\n", line);
+
+		switch (line[0]) {
+			case 'V':
+				fprintf(stderr, "LAN gateway uses AES encryption, which is not supported. Please remove the LAN key!\n");
+				return 0;
+			case 'S':
+				if ((sscanf(line + 1, "%2x,", &c) != 1) || (!strstr(line, channel))) {
+					fprintf(stderr, "Unexpected greeting from LAN gateway: %s\n", line);
+					return 0;
+				}
+
+				*cnt = c;
+				snprintf(ack, sizeof(ack), ">%02x,0000\r\n", *cnt);
+				return hmlgw_write_line(fd, ack);
+			default:
+				break;
+		}
+	}
+}
+
+static int hmlgw_keepalive(struct hmuartlgw_dev *dev)
+{
+	struct timeval tv;
+	char buf[16];
+
+	if (dev->ka_sent) {
+		if (++dev->ka_missed >= HMLGW_KEEPALIVE_MISSED) {
+			fprintf(stderr, "LAN gateway doesn't answer keepalives!\n");
+			return 0;
+		}
+	}
+
+	snprintf(buf, sizeof(buf), "K%02X\r\n", ++dev->ka_cnt);
+	dev->ka_sent = serial_now_us();
+	if (!hmlgw_write_line(dev->ka_fd, buf))
+		return 0;
+
+	tv.tv_sec = HMLGW_KEEPALIVE_INTERVAL;
+	tv.tv_usec = 0;
+
+	return reactor_timer_set(dev->reactor, dev->ka_timer, &tv);
+}
+
+static int hmlgw_keepalive_read(struct hmuartlgw_dev *dev)
+{
+	char line[sizeof(dev->ka_buf)];
+	unsigned int c;
+	int r;
+
+	r = read(dev->ka_fd, dev->ka_buf + dev->ka_pos, sizeof(dev->ka_buf) - dev->ka_pos);
+	if (r < 0) {
+		if (errno == EAGAIN)
+			return 1;
+		perror("read(hmlgw keepalive)");
+		return 0;
+	} else if (r == 0) {
+		fprintf(stderr, "LAN gateway closed the keepalive connection!\n");
+		return 0;
+	}
+
+	dev->ka_pos += r;
+
+	while (hmlgw_next_line(dev->ka_buf, &dev->ka_pos, line, sizeof(line)) >= 0) {
+		if (dev->debug)
+			fprintf(stderr, "LGW keepalive > %s\n", line);
+
+		if ((sscanf(line, ">K%2x", &c) == 1) && (c == dev->ka_cnt) && dev->ka_sent) {
+			serial_latency_add(&(dev->ka_rtt), serial_now_us() - dev->ka_sent);
+			dev->ka_sent = 0;
+			dev->ka_missed = 0;
+		}
+	}
+
+	/* No line end in a full buffer, nothing sensible in there */
+	if (dev->ka_pos == sizeof(dev->ka_buf))
+		dev->ka_pos = 0;
+
+	return 1;
+}
+
+/* device is host[:port] of a HM-LGW-O-TW-W-EU */
 struct hmuartlgw_dev *hmlgw_init(char *device, hmuartlgw_cb_fn cb, void *data)
 {
 	struct hmuartlgw_dev *dev = NULL;
+	uint8_t buf[sizeof(dev->rx)];
+	char host[256];
+	char line[32];
+	char *port_str;
+	int port = HMLGW_PORT;
+	int pos = 0;
+	uint8_t cnt;
+	struct timeval tv;
+
+	strncpy(host, device, sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+
+	/* Only split off a port if this isn't a bare IPv6 address */
+	port_str = strrchr(host, ':');
+	if (port_str && (strchr(host, ':') == port_str)) {
+		*port_str++ = '\0';
+		port = atoi(port_str);
+		if ((port <= 0) || (port >= 65535)) {
+			fprintf(stderr, "Invalid port: %s\n", port_str);
+			return NULL;
+		}
+	}
+
+	dev = malloc(sizeof(struct hmuartlgw_dev));
+	if (dev == NULL) {
+		perror("malloc(struct hmuartlgw_dev)");
+		return NULL;
+	}
+
+	memset(dev, 0, sizeof(struct hmuartlgw_dev));
+	dev->debug = debug;
+	dev->ka_fd = -1;
+	dev->read_chunk = sizeof(dev->rx);
+
+	crc16_init();
+
+	dev->fd = hmlgw_connect(host, port);
+	if (dev->fd < 0)
+		goto out;
+
+	dev->ka_fd = hmlgw_connect(host, port + 1);
+	if (dev->ka_fd < 0)
+		goto out2;
+
+	if (dev->debug) {
+		fprintf(stderr, "%s:%d and %s:%d connected\n", host, port, host, port + 1);
+	}
+
+	if (!hmlgw_handshake(dev, dev->fd, buf, &pos, sizeof(buf), "BidCoS-over-LAN", &cnt))
+		goto out2;
+
+	if (!hmlgw_handshake(dev, dev->ka_fd, dev->ka_buf, &(dev->ka_pos), sizeof(dev->ka_buf), "SysCom-over-LAN", &cnt))
+		goto out2;
+
+	/* Start the keepalive channel */
+	dev->ka_cnt = cnt + 1;
+	snprintf(line, sizeof(line), "L%02x,02,00ff,00\r\n", dev->ka_cnt);
+	if (!hmlgw_write_line(dev->ka_fd, line))
+		goto out2;
+
+	dev->reactor = reactor_init();
+	if ((!dev->reactor) ||
+	    (!reactor_add(dev->reactor, dev->fd, POLLIN, dev)) ||
+	    (!reactor_add(dev->reactor, dev->ka_fd, POLLIN, &(dev->ka_fd))))
+		goto out2;
+
+	dev->ka_timer = reactor_timer_add(dev->reactor, &(dev->ka_timer));
+	if (dev->ka_timer == -1)
+		goto out2;
+
+	tv.tv_sec = HMLGW_KEEPALIVE_INTERVAL;
+	tv.tv_usec = 0;
+	if (!reactor_timer_set(dev->reactor, dev->ka_timer, &tv))
+		goto out2;
+
+	/* Frames which arrived together with the greeting */
+	hmuartlgw_rx(dev, buf, pos);
+
+	hmuartlgw_enter_app(dev);
+
+	dev->cb = cb;
+	dev->cb_data = data;
 
 	return dev;
+
+out2:
+	if (dev->reactor)
+		reactor_close(dev->reactor);
+	if (dev->ka_fd >= 0)
+		close(dev->ka_fd);
+	if (dev->fd >= 0)
+		close(dev->fd);
+out:
+	free(dev);
+	return NULL;
+}
+
+struct hmuartlgw_probe {
+	int done;
+	enum hmuartlgw_state state;
+};
+
+static void hmuartlgw_probe_done(struct hmuartlgw_dev *dev, enum hmuartlgw_dst dst, uint8_t *buf, int buf_len, void *data)
+{
+	struct hmuartlgw_probe *probe = data;
+
+	probe->done = 1;
+
+	if ((!buf) || (buf_len < 2) || (buf[1] != 0x02))
+		return;
+
+	if ((buf_len >= 11) && !strncmp(((char*)buf)+2, "Co_CPU_BL", 9)) {
+		probe->state = HMUARTLGW_BOOTLOADER;
+	} else if ((buf_len >= 12) && !strncmp(((char*)buf)+2, "Co_CPU_App", 10)) {
+		probe->state = HMUARTLGW_APPLICATION;
+	}
+}
+
+/* Query the running application until the module answers for state,
+ * instead of sleeping until it has settled after a switch */
+static int hmuartlgw_wait_ready(struct hmuartlgw_dev *dev, enum hmuartlgw_state state)
+{
+	struct hmuartlgw_probe probe;
+	uint64_t deadline = (serial_now_us() / 1000) + HMUARTLGW_INIT_TIMEOUT;
+	int delay = HMUARTLGW_PROBE_DELAY;
+	int timeout = HMUARTLGW_PROBE_DELAY;
+	uint8_t buf[1];
+
+	while ((serial_now_us() / 1000) < deadline) {
+		memset(&probe, 0, sizeof(probe));
+		probe.state = HMUARTLGW_QUERY_APPSTATE;
+
+		/* Probes sent while the module resets get lost, so start with
+		 * a short timeout. A late ACK of an expired probe is dropped
+		 * by its frame counter. */
+		buf[0] = HMUARTLGW_OS_GET_APP;
+		if (hmuartlgw_send_req(dev, buf, 1, HMUARTLGW_OS, timeout, hmuartlgw_probe_done, &probe) < 0)
+			return 0;
+
+		while (!probe.done) {
+			errno = 0;
+			hmuartlgw_poll(dev, timeout);
+			if (errno && (errno != ETIMEDOUT))
+				return 0;
+		}
+
+		if (probe.state == state)
+			return 1;
+
+		if (probe.state == HMUARTLGW_QUERY_APPSTATE) {
+			/* Unanswered: the link may just be slow */
+			timeout *= 2;
+			if (timeout > HMUARTLGW_PROBE_TIMEOUT)
+				timeout = HMUARTLGW_PROBE_TIMEOUT;
+		} else {
+			/* Answered, but not switched yet: back off before the next probe */
+			usleep(delay * 1000);
+			if (delay < HMUARTLGW_PROBE_DELAY_MAX)
+				delay *= 2;
+		}
+	}
+
+	return 0;
+}
+
+/* Round trip of count GET_APP queries, returns how many were answered */
+int hmuartlgw_probe_latency(struct hmuartlgw_dev *dev, int count, struct serial_latency *lat)
+{
+	struct hmuartlgw_probe probe;
+	uint64_t start;
+	uint8_t buf[1];
+	int answered = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		memset(&probe, 0, sizeof(probe));
+		probe.state = HMUARTLGW_QUERY_APPSTATE;
+
+		buf[0] = HMUARTLGW_OS_GET_APP;
+		start = serial_now_us();
+		if (hmuartlgw_send_req(dev, buf, 1, HMUARTLGW_OS, HMUARTLGW_PROBE_TIMEOUT, hmuartlgw_probe_done, &probe) < 0)
+			break;
+
+		while (!probe.done) {
+			errno = 0;
+			hmuartlgw_poll(dev, HMUARTLGW_PROBE_TIMEOUT);
+			if (errno && (errno != ETIMEDOUT))
+				return answered;
+		}
+
+		if (probe.state == HMUARTLGW_QUERY_APPSTATE)
+			continue;
+
+		serial_latency_add(lat, serial_now_us() - start);
+		answered++;
+	}
+
+	return answered;
 }
 
 void hmuartlgw_enter_bootloader(struct hmuartlgw_dev *dev)
@@ -289,7 +717,7 @@ void hmuartlgw_enter_bootloader(struct hmuartlgw_dev *dev)
 	uint8_t buf[128] = { 0 };
 	int ret;
 
-	if (debug) {
+	if (dev->debug) {
 		fprintf(stderr, "Entering bootloader\n");
 	}
 
@@ -323,8 +751,10 @@ void hmuartlgw_enter_bootloader(struct hmuartlgw_dev *dev)
 			}
 		} while (rdata.state != HMUARTLGW_BOOTLOADER);
 
-		printf("Waiting for bootloader to settle...\n");
-		sleep(HMUARTLGW_SETTLE_TIME);
+		if (!hmuartlgw_wait_ready(dev, HMUARTLGW_BOOTLOADER)) {
+			fprintf(stderr, "Bootloader didn't become ready!\n");
+			exit(1);
+		}
 	}
 
 	dev->cb = cb_old;
@@ -339,7 +769,7 @@ void hmuartlgw_enter_app(struct hmuartlgw_dev *dev)
 	uint8_t buf[128] = { 0 };
 	int ret;
 
-	if (debug) {
+	if (dev->debug) {
 		fprintf(stderr, "Entering application\n");
 	}
 
@@ -376,8 +806,10 @@ void hmuartlgw_enter_app(struct hmuartlgw_dev *dev)
 		         (rdata.state != HMUARTLGW_DUAL_APPLICATION));
 
 		if (rdata.state == HMUARTLGW_APPLICATION) {
-			printf("Waiting for application to settle...\n");
-			sleep(HMUARTLGW_SETTLE_TIME);
+			if (!hmuartlgw_wait_ready(dev, HMUARTLGW_APPLICATION)) {
+				fprintf(stderr, "Application didn't become ready!\n");
+				exit(1);
+			}
 		}
 	}
 
@@ -391,150 +823,391 @@ void hmuartlgw_enter_app(struct hmuartlgw_dev *dev)
 	dev->cb_data = cb_data_old;
 }
 
-static int hmuartlgw_escape(uint8_t *frame, int framelen)
+/* Escape len bytes from in into out */
+static int hmuartlgw_escape(uint8_t *out, uint8_t *in, int len)
 {
+	uint8_t *pos = out;
+	uint8_t c;
 	int i;
 
-	for (i = 1; i < framelen; i++) {
-		if (frame[i] == 0xfc || frame[i] == 0xfd) {
-			memmove(frame + i + 1, frame + i, framelen - i);
-			frame[i++] = 0xfc;
-			frame[i] &= 0x7f;
-			framelen++;
+	for (i = 0; i < len; i++) {
+		c = in[i];
+
+		if (c == 0xfc || c == 0xfd) {
+			*pos++ = 0xfc;
+			*pos++ = c & 0x7f;
+		} else {
+			*pos++ = c;
 		}
 	}
-	return framelen;
+
+	return pos - out;
 }
 
-int hmuartlgw_send_raw(struct hmuartlgw_dev *dev, uint8_t *frame, int framelen)
+static int hmuartlgw_writev(int fd, struct iovec *iov, int iovcnt)
 {
-	int w = 0;
-	int ret;
+	struct pollfd pfd;
+	ssize_t ret;
 
-	if (debug) {
-		hexdump(frame, framelen, "UARTLGW < ");
-	}
+	while (iovcnt) {
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			/* LAN gateway sockets are non-blocking */
+			if (errno == EAGAIN) {
+				memset(&pfd, 0, sizeof(pfd));
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
 
-	framelen = hmuartlgw_escape(frame, framelen);
+				if (poll(&pfd, 1, HMLGW_WRITE_TIMEOUT) == 1)
+					continue;
 
-	do {
-		ret = write(dev->fd, frame + w, framelen - w);
-		if (ret < 0) {
-			perror("write");
+				fprintf(stderr, "Timeout writing to LAN gateway!\n");
+				return 0;
+			}
+
+			perror("writev");
 			return 0;
 		}
-		w += ret;
-	} while (w < framelen);
+
+		/* Short write, skip what was already written */
+		while (iovcnt && ((size_t)ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (uint8_t*)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
 
 	return 1;
 }
 
-int hmuartlgw_send(struct hmuartlgw_dev *dev, uint8_t *cmd, int cmdlen, enum hmuartlgw_dst dst)
+int hmuartlgw_send_raw(struct hmuartlgw_dev *dev, uint8_t *frame, int framelen)
 {
-	static uint8_t cnt = 0;
-	uint8_t frame[4096] = { 0 };
-	uint16_t crc;
-
-	frame[0] = 0xfd;
-	frame[1] = ((cmdlen + 2) >> 8) & 0xff;
-	frame[2] = (cmdlen + 2) & 0xff;
-	frame[3] = dst;
-	dev->last_send_cnt = cnt;
-	frame[4] = cnt++;
-	memcpy(&(frame[5]), cmd, cmdlen);
-	crc = crc16(frame, cmdlen + 5);
-	frame[cmdlen + 5] = (crc >> 8) & 0xff;
-	frame[cmdlen + 6] = crc & 0xff;
-
-	return hmuartlgw_send_raw(dev, frame, cmdlen + 7);
+	struct iovec iov[1];
+
+	if ((framelen < 1) || (framelen > HMUARTLGW_MAX_FRAME)) {
+		fprintf(stderr, "Invalid frame length: %d\n", framelen);
+		return 0;
+	}
+
+	if (dev->debug) {
+		hexdump(frame, framelen, "UARTLGW < ");
+	}
+
+	/* The start of frame is never escaped */
+	dev->tx[0] = frame[0];
+	iov[0].iov_base = dev->tx;
+	iov[0].iov_len = 1 + hmuartlgw_escape(dev->tx + 1, frame + 1, framelen - 1);
+
+	return hmuartlgw_writev(dev->fd, iov, 1);
 }
 
-int hmuartlgw_poll(struct hmuartlgw_dev *dev, int timeout)
+int hmuartlgw_send(struct hmuartlgw_dev *dev, uint8_t *cmd, int cmdlen, enum hmuartlgw_dst dst)
 {
-	struct pollfd pfds[1];
-	int ret;
-	int r = 0;
-	uint16_t crc;
+	struct iovec iov[3];
+	uint8_t header[5];
+	uint8_t header_esc[1 + (4 * 2)];
+	uint8_t trailer[2];
+	uint8_t trailer_esc[2 * 2];
+	uint16_t crc = CRC16_INIT;
+
+	if ((cmdlen < 0) || ((cmdlen + 7) > HMUARTLGW_MAX_FRAME)) {
+		fprintf(stderr, "Command too long: %d bytes\n", cmdlen);
+		return 0;
+	}
 
-	errno = 0;
+	crc16_init();
+
+	header[0] = 0xfd;
+	header[1] = ((cmdlen + 2) >> 8) & 0xff;
+	header[2] = (cmdlen + 2) & 0xff;
+	header[3] = dst;
+	dev->last_send_cnt = dev->cnt;
+	dev->req[dev->cnt].expired = 0;
+	header[4] = dev->cnt++;
+
+	crc = crc16(crc, header, 5);
+	crc = crc16(crc, cmd, cmdlen);
+
+	/* The start of frame is never escaped */
+	header_esc[0] = header[0];
+	iov[0].iov_base = header_esc;
+	iov[0].iov_len = 1 + hmuartlgw_escape(header_esc + 1, header + 1, 4);
+
+	iov[1].iov_base = dev->tx;
+	iov[1].iov_len = hmuartlgw_escape(dev->tx, cmd, cmdlen);
+
+	trailer[0] = (crc >> 8) & 0xff;
+	trailer[1] = crc & 0xff;
+	iov[2].iov_base = trailer_esc;
+	iov[2].iov_len = hmuartlgw_escape(trailer_esc, trailer, 2);
+
+	if (dev->debug) {
+		uint8_t *frame = malloc(cmdlen + 7);
+
+		if (frame) {
+			memcpy(frame, header, 5);
+			memcpy(frame + 5, cmd, cmdlen);
+			memcpy(frame + 5 + cmdlen, trailer, 2);
+			hexdump(frame, cmdlen + 7, "UARTLGW < ");
+			free(frame);
+		}
+	}
 
-	memset(pfds, 0, sizeof(struct pollfd) * 1);
+	return hmuartlgw_writev(dev->fd, iov, 3);
+}
 
-	pfds[0].fd = dev->fd;
-	pfds[0].events = POLLIN;
+static uint64_t hmuartlgw_now(void)
+{
+	return serial_now_us() / 1000;
+}
 
-	ret = poll(pfds, 1, timeout);
-	if (ret == -1)
-		return -1;
+/* Send a command and call cb with its ACK, returns the frame counter or -1 */
+int hmuartlgw_send_req(struct hmuartlgw_dev *dev, uint8_t *cmd, int cmdlen, enum hmuartlgw_dst dst,
+                       int timeout, hmuartlgw_req_cb_fn cb, void *data)
+{
+	struct hmuartlgw_req *req = &(dev->req[dev->cnt]);
+	int cnt = dev->cnt;
 
-	errno = 0;
-	if (ret == 0) {
-		errno = ETIMEDOUT;
+	if (req->cb) {
+		fprintf(stderr, "Too many requests in flight!\n");
 		return -1;
 	}
 
-	if (!(pfds[0].revents & POLLIN)) {
-		errno = EIO;
+	if (!hmuartlgw_send(dev, cmd, cmdlen, dst))
 		return -1;
-	}
 
-	r = read(dev->fd, dev->buf+dev->pos, 1);
-	if (r < 0)
-		return -1;
+	req->cb = cb;
+	req->data = data;
+	req->dst = dst;
+	req->sent = serial_now_us();
+	req->deadline = (req->sent / 1000) + timeout;
+	dev->n_req++;
 
-	if (r == 0) {
-		errno = EOF;
-		return -1;
-	}
+	return cnt;
+}
 
-	dev->pos += r;
+/* Hand an ACK to the request it belongs to, returns 0 if there is none */
+static int hmuartlgw_req_done(struct hmuartlgw_dev *dev, enum hmuartlgw_dst dst, uint8_t cnt, uint8_t *buf, int buf_len)
+{
+	struct hmuartlgw_req *req = &(dev->req[cnt]);
+	hmuartlgw_req_cb_fn cb = req->cb;
+	uint8_t ack = (dst == HMUARTLGW_OS) ? HMUARTLGW_OS_ACK : HMUARTLGW_APP_ACK;
 
-	if (dev->buf[0] != 0xfd) {
-		memset(dev->buf, 0, sizeof(dev->buf));
-		dev->pos = 0;
-		dev->unescape_next = 0;
-		return -1;
+	if ((req->dst != dst) || (buf_len < 1) || (buf[0] != ack))
+		return 0;
+
+	/* Too late, the request already failed */
+	if (req->expired) {
+		req->expired = 0;
+		return 1;
 	}
 
-	if (dev->unescape_next) {
-		dev->buf[dev->pos-1] |= 0x80;
-		dev->unescape_next = 0;
-	} else if (dev->buf[dev->pos-1] == 0xfc) {
-		dev->unescape_next = 1;
-		dev->pos--;
-		return -1;
+	if (!cb)
+		return 0;
+
+	serial_latency_add(&(dev->req_rtt), serial_now_us() - req->sent);
+
+	/* The callback may queue the next request on this slot */
+	req->cb = NULL;
+	dev->n_req--;
+	cb(dev, dst, buf, buf_len, req->data);
+
+	return 1;
+}
+
+/* Fail all requests past their deadline, returns how many there were */
+static int hmuartlgw_req_expire(struct hmuartlgw_dev *dev)
+{
+	struct hmuartlgw_req *req;
+	hmuartlgw_req_cb_fn cb;
+	uint64_t now;
+	int expired = 0;
+	int i;
+
+	if (!dev->n_req)
+		return 0;
+
+	now = hmuartlgw_now();
+	for (i = 0; i < 256; i++) {
+		req = &(dev->req[i]);
+		if ((!req->cb) || (req->deadline > now))
+			continue;
+
+		cb = req->cb;
+		req->cb = NULL;
+		req->expired = 1;
+		dev->n_req--;
+		cb(dev, req->dst, NULL, 0, req->data);
+		expired++;
 	}
 
-	if (dev->pos >= 3) {
-		uint16_t len;
+	return expired;
+}
 
-		len = ((dev->buf[1] << 8) & 0xff00) | (dev->buf[2] & 0xff);
+/* Milliseconds until the next request deadline, or -1 */
+static int hmuartlgw_req_next(struct hmuartlgw_dev *dev)
+{
+	uint64_t next = 0;
+	uint64_t now;
+	int i;
 
-		if (dev->pos < len + 5)
-			return -1;
-	} else {
+	if (!dev->n_req)
 		return -1;
+
+	for (i = 0; i < 256; i++) {
+		if (dev->req[i].cb && ((!next) || (dev->req[i].deadline < next)))
+			next = dev->req[i].deadline;
 	}
 
-	crc = crc16(dev->buf, dev->pos);
-	if (crc == 0x0000) {
-		if (debug)
-			hexdump(dev->buf, dev->pos, "UARTLGW > ");
+	now = hmuartlgw_now();
+	if (next <= now)
+		return 0;
 
-		dev->cb(dev->buf[3], dev->buf + 5 , dev->pos - 7, dev->cb_data);
+	return next - now;
+}
 
-		memset(dev->buf, 0, sizeof(dev->buf));
-		dev->pos = 0;
-		dev->unescape_next = 0;
+static void hmuartlgw_frame_done(struct hmuartlgw_dev *dev)
+{
+	/* CRC over the whole frame including the checksum is 0 */
+	if (dev->crc == 0x0000) {
+		if (dev->debug)
+			hexdump(dev->buf, dev->pos, "UARTLGW > ");
+
+		if ((!hmuartlgw_req_done(dev, dev->buf[3], dev->buf[4], dev->buf + 5, dev->pos - 7)) && dev->cb)
+			dev->cb(dev->buf[3], dev->buf + 5 , dev->pos - 7, dev->cb_data);
 	} else {
 		fprintf(stderr, "Invalid checksum received!\n");
 		hexdump(dev->buf, dev->pos, "ERR> ");
-		printf("calculated: %04x\n", crc);
+		printf("calculated: %04x\n", dev->crc);
+	}
+}
+
+/* Unescape and frame a chunk of received bytes, dispatching all complete frames */
+static void hmuartlgw_rx(struct hmuartlgw_dev *dev, uint8_t *data, int len)
+{
+	uint16_t frame_len;
+	uint8_t c;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		c = data[i];
+
+		/* Wait for start of frame */
+		if (dev->pos == 0) {
+			if (c != 0xfd)
+				continue;
+			dev->crc = CRC16_INIT;
+		}
+
+		if (dev->unescape_next) {
+			c |= 0x80;
+			dev->unescape_next = 0;
+		} else if (c == 0xfc) {
+			dev->unescape_next = 1;
+			continue;
+		}
+
+		dev->buf[dev->pos++] = c;
+		dev->crc = CRC16_UPDATE(dev->crc, c);
+
+		if (dev->pos < 3)
+			continue;
+
+		frame_len = ((dev->buf[1] << 8) & 0xff00) | (dev->buf[2] & 0xff);
+		if ((frame_len + 5) > sizeof(dev->buf)) {
+			fprintf(stderr, "Received frame too long (%u bytes), discarding!\n", frame_len);
+			dev->pos = 0;
+			dev->unescape_next = 0;
+			continue;
+		}
+
+		if (dev->pos < frame_len + 5)
+			continue;
+
+		hmuartlgw_frame_done(dev);
 
-		memset(dev->buf, 0, sizeof(dev->buf));
 		dev->pos = 0;
 		dev->unescape_next = 0;
 	}
+}
+
+int hmuartlgw_poll(struct hmuartlgw_dev *dev, int timeout)
+{
+	struct reactor_event ev[3];
+	int req_timeout;
+	int ret;
+	int r = 0;
+	int i;
+
+	errno = 0;
+
+	/* Wake up in time for the next request deadline */
+	req_timeout = hmuartlgw_req_next(dev);
+	if ((req_timeout >= 0) && ((timeout < 0) || (req_timeout < timeout)))
+		timeout = req_timeout;
+	else
+		req_timeout = -1;
+
+	ret = reactor_wait(dev->reactor, ev, 3, timeout);
+	if (ret == -1)
+		return -1;
+
+	if (ret == 0) {
+		/* Only a stale timer */
+		if (errno == EAGAIN) {
+			errno = 0;
+			return -1;
+		}
+
+		errno = 0;
+		if ((!hmuartlgw_req_expire(dev)) && (req_timeout == -1))
+			errno = ETIMEDOUT;
+		return -1;
+	}
+
+	for (i = 0; i < ret; i++) {
+		if (ev[i].data == &(dev->ka_timer)) {
+			if (!hmlgw_keepalive(dev)) {
+				errno = EIO;
+				return -1;
+			}
+			continue;
+		}
+
+		if (!(ev[i].revents & POLLIN)) {
+			errno = EIO;
+			return -1;
+		}
+
+		if (ev[i].data == &(dev->ka_fd)) {
+			if (!hmlgw_keepalive_read(dev)) {
+				errno = EIO;
+				return -1;
+			}
+			continue;
+		}
+
+		/* Everything which is available right now */
+		r = read(dev->fd, dev->rx, dev->read_chunk);
+		if (r < 0) {
+			if (errno == EAGAIN)
+				continue;
+			return -1;
+		}
+
+		if (r == 0) {
+			errno = EOF;
+			return -1;
+		}
+
+		hmuartlgw_rx(dev, dev->rx, r);
+	}
+
+	hmuartlgw_req_expire(dev);
 
 	errno = 0;
 	return -1;
@@ -542,38 +1215,40 @@ int hmuartlgw_poll(struct hmuartlgw_dev *dev, int timeout)
 
 void hmuartlgw_close(struct hmuartlgw_dev *dev)
 {
+	if (dev->debug) {
+		serial_latency_print("Request", &(dev->req_rtt));
+		serial_latency_print("Keepalive", &(dev->ka_rtt));
+	}
+
+	reactor_close(dev->reactor);
+	if (dev->ka_fd >= 0)
+		close(dev->ka_fd);
 	close(dev->fd);
 }
 
+/* Drop everything the module sent so far, including a frame in progress */
 void hmuartlgw_flush(struct hmuartlgw_dev *dev)
 {
 	struct pollfd pfds[1];
-	int ret;
-	int r = 0;
-	uint8_t buf[1024];
+	int r;
 
 	tcflush(dev->fd, TCIOFLUSH);
 
-	while(1) {
-		memset(pfds, 0, sizeof(struct pollfd) * 1);
-
-		pfds[0].fd = dev->fd;
-		pfds[0].events = POLLIN;
-
-		ret = poll(pfds, 1, 100);
-		if (ret <= 0)
-			break;
+	memset(pfds, 0, sizeof(struct pollfd) * 1);
+	pfds[0].fd = dev->fd;
+	pfds[0].events = POLLIN;
 
+	while (poll(pfds, 1, HMUARTLGW_FLUSH_QUIET) == 1) {
 		if (!(pfds[0].revents & POLLIN))
 			break;
 
-		memset(buf, 0, sizeof(buf));
-		r = read(dev->fd, buf, sizeof(buf));
+		r = read(dev->fd, dev->rx, sizeof(dev->rx));
 		if (r <= 0)
 			break;
 	}
 
-	return;
+	dev->pos = 0;
+	dev->unescape_next = 0;
 }
 
 void hmuartlgw_set_debug(int d)
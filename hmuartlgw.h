@@ -59,25 +59,73 @@ enum hmuartlgw_dst {
 	HMUARTLGW_DUAL_ERR = 0xff,
 };
 
+#define HMUARTLGW_SPEED		115200
+
+#define HMUARTLGW_MAX_FRAME	4096	/* unescaped, including header and CRC */
+
 typedef int (*hmuartlgw_cb_fn)(enum hmuartlgw_dst dst, uint8_t *buf, int buf_len, void *data);
 
+struct hmuartlgw_dev;
+
+/* Called with the ACK of a request, or with buf == NULL if none arrived in time */
+typedef void (*hmuartlgw_req_cb_fn)(struct hmuartlgw_dev *dev, enum hmuartlgw_dst dst, uint8_t *buf, int buf_len, void *data);
+
+/* A request waiting for its ACK, indexed by the frame counter */
+struct hmuartlgw_req {
+	hmuartlgw_req_cb_fn cb;	/* NULL if the slot is free */
+	void *data;
+	enum hmuartlgw_dst dst;
+	int expired;		/* timed out, a late ACK is dropped */
+	uint64_t deadline;	/* ms, CLOCK_MONOTONIC */
+	uint64_t sent;		/* us, CLOCK_MONOTONIC */
+};
+
+struct reactor;
+struct serial_opts;
+
+/* All state of an opened device lives here, different devices can be
+ * used from different threads. */
 struct hmuartlgw_dev {
 	int fd;
+	struct reactor *reactor;
 	hmuartlgw_cb_fn cb;
 	void *cb_data;
+	uint8_t cnt;		/* sequence number of the next frame */
 	uint8_t last_send_cnt;
-	uint8_t buf[1024];
+	int debug;
+	uint8_t buf[1024];	/* unescaped frame being received */
 	int pos;
 	int unescape_next;
+	uint16_t crc;		/* running CRC of buf */
+	uint8_t rx[1024];	/* raw bytes from the last read() */
+	int read_chunk;		/* bytes per read(), at most sizeof(rx) */
+	uint8_t tx[HMUARTLGW_MAX_FRAME * 2];	/* escaped frame being sent */
+	struct hmuartlgw_req req[256];
+	int n_req;
+	struct serial_latency req_rtt;	/* command to ACK */
+
+	/* HM-LGW-O-TW-W-EU keepalive channel, ka_fd is -1 for HM-MOD-UART */
+	int ka_fd;
+	int ka_timer;
+	uint8_t ka_cnt;
+	int ka_missed;
+	uint64_t ka_sent;	/* us, 0 if no keepalive is outstanding */
+	uint8_t ka_buf[128];
+	int ka_pos;
+	struct serial_latency ka_rtt;
 };
 
 struct hmuartlgw_dev *hmuart_init(char *device, hmuartlgw_cb_fn cb, void *data, int app);
+struct hmuartlgw_dev *hmuart_init_opts(char *device, struct serial_opts *opts, hmuartlgw_cb_fn cb, void *data, int app);
 struct hmuartlgw_dev *hmlgw_init(char *device, hmuartlgw_cb_fn cb, void *data);
 int hmuartlgw_send_raw(struct hmuartlgw_dev *dev, uint8_t *frame, int framelen);
 int hmuartlgw_send(struct hmuartlgw_dev *dev, uint8_t *cmd, int cmdlen, enum hmuartlgw_dst dst);
+int hmuartlgw_send_req(struct hmuartlgw_dev *dev, uint8_t *cmd, int cmdlen, enum hmuartlgw_dst dst,
+                       int timeout, hmuartlgw_req_cb_fn cb, void *data);
 int hmuartlgw_poll(struct hmuartlgw_dev *dev, int timeout);
 void hmuartlgw_close(struct hmuartlgw_dev *dev);
 void hmuartlgw_flush(struct hmuartlgw_dev *dev);
 void hmuartlgw_enter_bootloader(struct hmuartlgw_dev *dev);
 void hmuartlgw_enter_app(struct hmuartlgw_dev *dev);
-void hmuartlgw_set_debug(int d);
+int hmuartlgw_probe_latency(struct hmuartlgw_dev *dev, int count, struct serial_latency *lat);
+void hmuartlgw_set_debug(int d);	/* default for devices opened afterwards */
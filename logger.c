@@ -0,0 +1,391 @@
+/* asynchronous logger
+ *
+ * Copyright (c) 2013-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "logger.h"
+
+#define LOG_RING_SIZE		(256 * 1024)	/* must be a power of 2 */
+#define LOG_MAX_PREFIX		128
+#define LOG_MAX_PAYLOAD		8192
+
+#define LOG_TYPE_LINE		0
+#define LOG_TYPE_HEXDUMP	1
+
+struct log_record {
+	struct timeval tv;
+	uint32_t len;
+	uint8_t type;
+	uint8_t prefix_len;
+};
+
+static uint8_t ring[LOG_RING_SIZE];
+static uint32_t ring_head = 0;	/* written by the producer only */
+static uint32_t ring_tail = 0;	/* written by the logger thread only */
+static unsigned long dropped = 0;
+static unsigned long reported_dropped = 0;	/* logger thread only */
+static int running = 0;
+static int stop = 0;
+static pthread_t thread;
+
+/* The thread sleeps on wake while the ring is empty. Producers only
+ * take the lock when it announced that via waiting. */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int waiting = 0;
+static unsigned long wakeups = 0;
+
+static FILE *log_file = NULL;
+static int log_flags = 0;
+
+/* Only touched by whoever formats: the logger thread or the direct path */
+static time_t ts_sec = -1;
+static char ts_prefix[32];
+static int ts_len = 0;
+static char line[LOG_MAX_PREFIX + LOG_MAX_PAYLOAD + 64];
+
+static void update_timestamp(time_t sec)
+{
+	struct tm tm;
+
+	if (sec == ts_sec)
+		return;
+
+	localtime_r(&sec, &tm);
+	ts_len = strftime(ts_prefix, sizeof(ts_prefix), "%Y-%m-%d %H:%M:%S", &tm);
+	ts_sec = sec;
+}
+
+static void format_line(struct timeval *tv, char *prefix, int prefix_len, uint8_t *buf, int len)
+{
+	int l;
+
+	update_timestamp(tv->tv_sec);
+
+	memcpy(line, ts_prefix, ts_len);
+	l = ts_len;
+	l += snprintf(line + l, sizeof(line) - l, ".%06ld: ", (long)tv->tv_usec);
+	memcpy(line + l, prefix, prefix_len);
+	l += prefix_len;
+	if (len) {
+		memcpy(line + l, buf, len);
+		l += len;
+		line[l++] = '\n';
+	}
+
+	if (log_file)
+		fwrite(line, l, 1, log_file);
+	if (log_flags & LOGGER_STDOUT)
+		fwrite(line, l, 1, stdout);
+}
+
+/* Same layout as hexdump() in hexdump.h */
+static void format_hexdump(char *prefix, unsigned char *buf, int len)
+{
+	char *pos = line;
+	int i, j;
+
+	pos += sprintf(pos, "\n%s", prefix);
+	for (i = 0; i < len; i++) {
+		if ((i % 16) == 0)
+			pos += sprintf(pos, "0x%04x: ", i);
+		pos += sprintf(pos, "%02x ", buf[i]);
+		if ((i % 16) == 15) {
+			*pos++ = ' ';
+			*pos++ = ' ';
+			for (j = i - 15; j <= i; j++)
+				*pos++ = ((buf[j] >= 32) && (buf[j] <= 126)) ? buf[j] : '.';
+			if (i != (len - 1))
+				pos += sprintf(pos, "\n%s", prefix);
+		}
+
+		/* Flush long dumps in pieces */
+		if ((pos - line) > (int)(sizeof(line) - 256)) {
+			fwrite(line, pos - line, 1, stderr);
+			pos = line;
+		}
+	}
+	for (j = (i % 16); j < 16; j++) {
+		memcpy(pos, "   ", 3);
+		pos += 3;
+	}
+	*pos++ = ' ';
+	*pos++ = ' ';
+	for (j = i - (i % 16); j < i; j++)
+		*pos++ = ((buf[j] >= 32) && (buf[j] <= 126)) ? buf[j] : '.';
+	*pos++ = '\n';
+
+	fwrite(line, pos - line, 1, stderr);
+}
+
+static void ring_read(uint32_t pos, void *dst, int len)
+{
+	uint32_t off = pos & (LOG_RING_SIZE - 1);
+	int first = LOG_RING_SIZE - off;
+
+	if (first > len)
+		first = len;
+
+	memcpy(dst, ring + off, first);
+	memcpy((uint8_t*)dst + first, ring, len - first);
+}
+
+static void ring_write(uint32_t pos, void *src, int len)
+{
+	uint32_t off = pos & (LOG_RING_SIZE - 1);
+	int first = LOG_RING_SIZE - off;
+
+	if (first > len)
+		first = len;
+
+	memcpy(ring + off, src, first);
+	memcpy(ring, (uint8_t*)src + first, len - first);
+}
+
+static void wake_thread(void)
+{
+	if (!__atomic_load_n(&waiting, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&wake_lock);
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&wake_lock);
+}
+
+static int queue_record(int type, char *prefix, int prefix_len, uint8_t *buf, int len)
+{
+	struct log_record rec;
+	uint32_t head = ring_head;
+	uint32_t tail;
+	uint32_t need;
+
+	if (len > LOG_MAX_PAYLOAD)
+		len = LOG_MAX_PAYLOAD;
+
+	need = sizeof(rec) + prefix_len + len;
+
+	tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+	if ((LOG_RING_SIZE - (head - tail)) < need) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		wake_thread();
+		return 0;
+	}
+
+	gettimeofday(&rec.tv, NULL);
+	rec.len = len;
+	rec.type = type;
+	rec.prefix_len = prefix_len;
+
+	ring_write(head, &rec, sizeof(rec));
+	ring_write(head + sizeof(rec), prefix, prefix_len);
+	ring_write(head + sizeof(rec) + prefix_len, buf, len);
+
+	__atomic_store_n(&ring_head, head + need, __ATOMIC_SEQ_CST);
+	wake_thread();
+
+	return 1;
+}
+
+static int drain(void)
+{
+	static unsigned char payload[LOG_MAX_PAYLOAD];
+	char prefix[LOG_MAX_PREFIX];
+	struct log_record rec;
+	unsigned long d;
+	uint32_t head;
+	uint32_t tail = ring_tail;
+	int records = 0;
+
+	head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+
+	while (tail != head) {
+		ring_read(tail, &rec, sizeof(rec));
+		ring_read(tail + sizeof(rec), prefix, rec.prefix_len);
+		ring_read(tail + sizeof(rec) + rec.prefix_len, payload, rec.len);
+
+		tail += sizeof(rec) + rec.prefix_len + rec.len;
+		__atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+
+		if (rec.type == LOG_TYPE_HEXDUMP) {
+			prefix[rec.prefix_len] = '\0';
+			format_hexdump(prefix, payload, rec.len);
+		} else {
+			format_line(&rec.tv, prefix, rec.prefix_len, payload, rec.len);
+		}
+
+		records++;
+	}
+
+	d = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (d != reported_dropped) {
+		if (log_file)
+			fprintf(log_file, "logger: %lu records dropped\n", d - reported_dropped);
+		if (log_flags & LOGGER_STDOUT)
+			printf("logger: %lu records dropped\n", d - reported_dropped);
+		reported_dropped = d;
+	}
+
+	if (records) {
+		if (log_file)
+			fflush(log_file);
+		if (log_flags & LOGGER_STDOUT)
+			fflush(stdout);
+	}
+
+	return records;
+}
+
+static void *logger_thread(void *arg)
+{
+	while (1) {
+		if (drain())
+			continue;
+
+		if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+			break;
+
+		/* Announce the sleep before the final check, so a record
+		 * queued in between either is seen here or signals us */
+		pthread_mutex_lock(&wake_lock);
+		__atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+		while ((__atomic_load_n(&ring_head, __ATOMIC_SEQ_CST) == ring_tail) &&
+		       (__atomic_load_n(&dropped, __ATOMIC_RELAXED) == reported_dropped) &&
+		       (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))) {
+			pthread_cond_wait(&wake, &wake_lock);
+			__atomic_add_fetch(&wakeups, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&waiting, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&wake_lock);
+	}
+
+	return NULL;
+}
+
+int logger_init(FILE *logfile, int flags)
+{
+	int err;
+
+	log_file = logfile;
+	log_flags = flags;
+
+	if (running)
+		return 1;
+
+	err = pthread_create(&thread, NULL, logger_thread, NULL);
+	if (err) {
+		fprintf(stderr, "Can't start logger thread: %s, logging synchronously\n", strerror(err));
+		return 0;
+	}
+
+	running = 1;
+
+	return 1;
+}
+
+void logger_exit(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&wake_lock);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&wake_lock);
+	pthread_join(thread, NULL);
+
+	running = 0;
+	stop = 0;
+}
+
+void logger_vlog(uint8_t *buf, int len, char *fmt, va_list ap)
+{
+	char prefix[LOG_MAX_PREFIX];
+	struct timeval tv;
+	int prefix_len = 0;
+
+	if ((!log_file) && (!(log_flags & LOGGER_STDOUT)))
+		return;
+
+	if ((!buf) || (len < 0))
+		len = 0;
+
+	if (fmt) {
+		prefix_len = vsnprintf(prefix, sizeof(prefix), fmt, ap);
+
+		if (prefix_len < 0)
+			prefix_len = 0;
+		if (prefix_len >= (int)sizeof(prefix))
+			prefix_len = sizeof(prefix) - 1;
+	}
+
+	if (running) {
+		queue_record(LOG_TYPE_LINE, prefix, prefix_len, buf, len);
+		return;
+	}
+
+	gettimeofday(&tv, NULL);
+	format_line(&tv, prefix, prefix_len, buf, (len > LOG_MAX_PAYLOAD) ? LOG_MAX_PAYLOAD : len);
+	if (log_file)
+		fflush(log_file);
+}
+
+void logger_log(uint8_t *buf, int len, char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	logger_vlog(buf, len, fmt, ap);
+	va_end(ap);
+}
+
+void logger_hexdump(unsigned char *buf, int len, char *prefix)
+{
+	int prefix_len = strlen(prefix);
+
+	if (prefix_len >= LOG_MAX_PREFIX)
+		prefix_len = LOG_MAX_PREFIX - 1;
+
+	if (running) {
+		queue_record(LOG_TYPE_HEXDUMP, prefix, prefix_len, buf, len);
+		return;
+	}
+
+	format_hexdump(prefix, buf, (len > LOG_MAX_PAYLOAD) ? LOG_MAX_PAYLOAD : len);
+}
+
+unsigned long logger_dropped(void)
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+unsigned long logger_wakeups(void)
+{
+	return __atomic_load_n(&wakeups, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,35 @@
+/* asynchronous logger
+ *
+ * Copyright (c) 2013-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define LOGGER_STDOUT	(1 << 0)	/* write log lines to stdout, too */
+
+/* Records are only queued by a single thread, formatting happens in the
+ * background. The thread only wakes up when records are queued. Without
+ * a running logger everything is written directly. */
+int logger_init(FILE *logfile, int flags);
+void logger_exit(void);
+void logger_vlog(uint8_t *buf, int len, char *fmt, va_list ap);
+void logger_log(uint8_t *buf, int len, char *fmt, ...);
+void logger_hexdump(unsigned char *buf, int len, char *prefix);
+unsigned long logger_dropped(void);
+unsigned long logger_wakeups(void);
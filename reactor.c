@@ -0,0 +1,343 @@
+/* epoll/timerfd based event loop
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/time.h>
+
+#include "reactor.h"
+
+struct reactor_fd {
+	int fd;
+	int timer;
+	int always;	/* not pollable (regular file), always ready */
+	short events;
+	void *data;
+	struct reactor_fd *next;
+};
+
+struct reactor {
+	int epfd;
+	struct reactor_fd *fds;
+	int always;	/* number of always ready fds */
+};
+
+static uint32_t poll_to_epoll(short events)
+{
+	uint32_t ev = 0;
+
+	if (events & POLLIN)
+		ev |= EPOLLIN;
+	if (events & POLLPRI)
+		ev |= EPOLLPRI;
+	if (events & POLLOUT)
+		ev |= EPOLLOUT;
+
+	return ev;
+}
+
+static short epoll_to_poll(uint32_t ev)
+{
+	short events = 0;
+
+	if (ev & EPOLLIN)
+		events |= POLLIN;
+	if (ev & EPOLLPRI)
+		events |= POLLPRI;
+	if (ev & EPOLLOUT)
+		events |= POLLOUT;
+	if (ev & EPOLLERR)
+		events |= POLLERR;
+	if (ev & EPOLLHUP)
+		events |= POLLHUP;
+
+	return events;
+}
+
+static struct reactor_fd *reactor_find(struct reactor *r, int fd)
+{
+	struct reactor_fd *rfd;
+
+	for (rfd = r->fds; rfd; rfd = rfd->next) {
+		if (rfd->fd == fd)
+			return rfd;
+	}
+
+	return NULL;
+}
+
+struct reactor *reactor_init(void)
+{
+	struct reactor *r;
+
+	r = malloc(sizeof(struct reactor));
+	if (!r) {
+		perror("malloc(struct reactor)");
+		return NULL;
+	}
+
+	memset(r, 0, sizeof(struct reactor));
+
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd == -1) {
+		perror("epoll_create1");
+		free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+void reactor_close(struct reactor *r)
+{
+	struct reactor_fd *rfd;
+
+	if (!r)
+		return;
+
+	while (r->fds) {
+		rfd = r->fds;
+		r->fds = rfd->next;
+
+		if (rfd->timer)
+			close(rfd->fd);
+		free(rfd);
+	}
+
+	close(r->epfd);
+	free(r);
+}
+
+static int reactor_add_fd(struct reactor *r, int fd, short events, void *data, int timer)
+{
+	struct reactor_fd *rfd;
+	struct epoll_event ev;
+
+	rfd = malloc(sizeof(struct reactor_fd));
+	if (!rfd) {
+		perror("malloc(struct reactor_fd)");
+		return 0;
+	}
+
+	memset(rfd, 0, sizeof(struct reactor_fd));
+	rfd->fd = fd;
+	rfd->timer = timer;
+	rfd->events = events;
+	rfd->data = data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = poll_to_epoll(events);
+	ev.data.ptr = rfd;
+
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		/* epoll refuses regular files, which poll() reports as always
+		 * readable and writable (e.g. stdin redirected from a file) */
+		if ((errno == EPERM) && !timer) {
+			rfd->always = 1;
+			r->always++;
+		} else {
+			perror("epoll_ctl(EPOLL_CTL_ADD)");
+			free(rfd);
+			return 0;
+		}
+	}
+
+	rfd->next = r->fds;
+	r->fds = rfd;
+
+	return 1;
+}
+
+int reactor_add(struct reactor *r, int fd, short events, void *data)
+{
+	return reactor_add_fd(r, fd, events, data, 0);
+}
+
+int reactor_mod(struct reactor *r, int fd, short events)
+{
+	struct reactor_fd *rfd;
+	struct epoll_event ev;
+
+	rfd = reactor_find(r, fd);
+	if (!rfd)
+		return 0;
+
+	rfd->events = events;
+	if (rfd->always)
+		return 1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = poll_to_epoll(events);
+	ev.data.ptr = rfd;
+
+	if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+		perror("epoll_ctl(EPOLL_CTL_MOD)");
+		return 0;
+	}
+
+	return 1;
+}
+
+int reactor_del(struct reactor *r, int fd)
+{
+	struct reactor_fd **rfdp;
+	struct reactor_fd *rfd;
+
+	for (rfdp = &(r->fds); *rfdp; rfdp = &((*rfdp)->next)) {
+		if ((*rfdp)->fd == fd)
+			break;
+	}
+
+	if (!*rfdp)
+		return 0;
+
+	rfd = *rfdp;
+	*rfdp = rfd->next;
+
+	if (rfd->always) {
+		r->always--;
+	} else {
+		/* The fd may already be closed, which removes it from the epoll set */
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+	}
+
+	if (rfd->timer)
+		close(rfd->fd);
+	free(rfd);
+
+	return 1;
+}
+
+/* Returns the fd of a new, disarmed timer */
+int reactor_timer_add(struct reactor *r, void *data)
+{
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	if (!reactor_add_fd(r, fd, POLLIN, data, 1)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* One-shot timer relative to now, NULL disarms it */
+int reactor_timer_set(struct reactor *r, int fd, struct timeval *timeout)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (timeout) {
+		its.it_value.tv_sec = timeout->tv_sec;
+		its.it_value.tv_nsec = timeout->tv_usec * 1000;
+
+		/* 0 would disarm the timer */
+		if ((its.it_value.tv_sec == 0) && (its.it_value.tv_nsec == 0))
+			its.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		return 0;
+	}
+
+	return 1;
+}
+
+int reactor_timer_del(struct reactor *r, int fd)
+{
+	return reactor_del(r, fd);
+}
+
+/* Returns the number of events or -1 on error. 0 is returned with errno set
+ * to ETIMEDOUT on timeout or to EAGAIN when only stale timers fired. */
+int reactor_wait(struct reactor *r, struct reactor_event *ev, int max_ev, int timeout)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	struct reactor_fd *rfd;
+	uint64_t expirations;
+	int n;
+	int i;
+	int j = 0;
+
+	if (max_ev > REACTOR_MAX_EVENTS)
+		max_ev = REACTOR_MAX_EVENTS;
+
+	/* Always ready fds are reported first, epoll is then only polled */
+	for (rfd = (r->always ? r->fds : NULL); rfd && (j < max_ev); rfd = rfd->next) {
+		if ((!rfd->always) || !(rfd->events & (POLLIN | POLLOUT)))
+			continue;
+
+		ev[j].fd = rfd->fd;
+		ev[j].revents = rfd->events & (POLLIN | POLLOUT);
+		ev[j].data = rfd->data;
+		j++;
+	}
+
+	if (j)
+		timeout = 0;
+
+	if (j == max_ev)
+		return j;
+
+	n = epoll_wait(r->epfd, events, max_ev - j, timeout);
+	if (n == -1)
+		return (j ? j : -1);
+
+	if ((n == 0) && (j == 0)) {
+		errno = ETIMEDOUT;
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		rfd = events[i].data.ptr;
+
+		/* Re-armed or disarmed since it expired */
+		if (rfd->timer && (read(rfd->fd, &expirations, sizeof(expirations)) != sizeof(expirations)))
+			continue;
+
+		ev[j].fd = rfd->fd;
+		ev[j].revents = epoll_to_poll(events[i].events);
+		ev[j].data = rfd->data;
+		j++;
+	}
+
+	/* Only stale timers fired, caller should simply wait again */
+	if (j == 0)
+		errno = EAGAIN;
+
+	return j;
+}
@@ -0,0 +1,42 @@
+/* epoll/timerfd based event loop
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define REACTOR_MAX_EVENTS	16
+
+struct reactor;
+
+struct reactor_event {
+	int fd;
+	short revents;	/* POLLIN, POLLOUT, ... */
+	void *data;
+};
+
+struct reactor *reactor_init(void);
+void reactor_close(struct reactor *r);
+int reactor_add(struct reactor *r, int fd, short events, void *data);
+int reactor_mod(struct reactor *r, int fd, short events);
+int reactor_del(struct reactor *r, int fd);
+int reactor_timer_add(struct reactor *r, void *data);
+int reactor_timer_set(struct reactor *r, int fd, struct timeval *timeout);
+int reactor_timer_del(struct reactor *r, int fd);
+int reactor_wait(struct reactor *r, struct reactor_event *ev, int max_ev, int timeout);
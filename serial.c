@@ -0,0 +1,261 @@
+/* serial port setup
+ *
+ * Copyright (c) 2013-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#else
+#include <termios.h>
+#endif
+
+#include "serial.h"
+
+void serial_opts_init(struct serial_opts *opts, uint32_t speed)
+{
+	memset(opts, 0, sizeof(struct serial_opts));
+	opts->speed = speed;
+	opts->vmin = 1;
+	opts->vtime = 0;
+	opts->low_latency = 1;
+	opts->read_chunk = SERIAL_DEFAULT_READ_CHUNK;
+}
+
+void serial_opts_syntax(void)
+{
+	fprintf(stderr, "\t-m vmin\t\tserial VMIN, bytes a read() waits for (default: 1)\n");
+	fprintf(stderr, "\t-t vtime\tserial VTIME, inter-byte timeout in 1/10 s (default: 0)\n");
+	fprintf(stderr, "\t-r bytes\tread at most \"bytes\" per read() (default: %d)\n", SERIAL_DEFAULT_READ_CHUNK);
+	fprintf(stderr, "\t-n\t\tdon't ask the serial driver for low latency mode\n");
+}
+
+static int serial_opt_num(char *arg, long min, long max, int *val)
+{
+	char *endptr = NULL;
+	long v;
+
+	v = strtol(arg, &endptr, 10);
+	if ((*arg == '\0') || (*endptr != '\0') || (v < min) || (v > max))
+		return 0;
+
+	*val = v;
+
+	return 1;
+}
+
+/* Handle one of the SERIAL_GETOPT options, returns 0 if arg is invalid */
+int serial_opts_getopt(struct serial_opts *opts, int opt, char *arg)
+{
+	switch (opt) {
+		case 'm':
+			return serial_opt_num(arg, 0, 255, &(opts->vmin));
+		case 't':
+			return serial_opt_num(arg, 0, 255, &(opts->vtime));
+		case 'r':
+			return serial_opt_num(arg, 1, 65536, &(opts->read_chunk));
+		case 'n':
+			opts->low_latency = 0;
+			return 1;
+	}
+
+	return 0;
+}
+
+int serial_set_low_latency(int fd, int enable)
+{
+#ifdef ASYNC_LOW_LATENCY
+	struct serial_struct ss;
+
+	if (ioctl(fd, TIOCGSERIAL, &ss) == -1)
+		return 0;
+
+	if (enable) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+	} else {
+		ss.flags &= ~ASYNC_LOW_LATENCY;
+	}
+
+	if (ioctl(fd, TIOCSSERIAL, &ss) == -1)
+		return 0;
+
+	return 1;
+#else
+	errno = ENOTSUP;
+	return 0;
+#endif
+}
+
+#ifdef __linux__
+/* termios2 with BOTHER takes the rate as a number */
+static int serial_setup(int fd, struct serial_opts *opts)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) == -1) {
+		perror("TCGETS2");
+		return 0;
+	}
+
+	memset(&tio, 0, sizeof(tio));
+
+	tio.c_cflag = BOTHER | (BOTHER << IBSHIFT) | CS8 | CLOCAL | CREAD;
+	tio.c_ispeed = opts->speed;
+	tio.c_ospeed = opts->speed;
+	tio.c_iflag = IGNPAR | (opts->canonical ? ICRNL : 0);
+	tio.c_oflag = 0;
+	tio.c_lflag = opts->canonical ? ICANON : 0;
+	tio.c_cc[VTIME] = opts->vtime;
+	tio.c_cc[VMIN] = opts->vmin;
+
+	ioctl(fd, TCFLSH, TCIFLUSH);
+	if (ioctl(fd, TCSETS2, &tio) == -1) {
+		perror("TCSETS2");
+		return 0;
+	}
+
+	return 1;
+}
+#else
+static int serial_setup(int fd, struct serial_opts *opts)
+{
+	struct termios tio;
+	speed_t brate;
+
+	switch(opts->speed) {
+		case 230400:
+			brate = B230400;
+			break;
+		case 115200:
+			brate = B115200;
+			break;
+		case 57600:
+			brate = B57600;
+			break;
+		case 38400:
+			brate = B38400;
+			break;
+		case 19200:
+			brate = B19200;
+			break;
+		case 9600:
+			brate = B9600;
+			break;
+		default:
+			fprintf(stderr, "Unsupported baud-rate: %u\n", opts->speed);
+			return 0;
+			break;
+	}
+
+	if (tcgetattr(fd, &tio) == -1) {
+		perror("tcgetattr");
+		return 0;
+	}
+
+	memset(&tio, 0, sizeof(tio));
+
+	tio.c_cflag = CS8 | CLOCAL | CREAD;
+	tio.c_iflag = IGNPAR | (opts->canonical ? ICRNL : 0);
+	tio.c_oflag = 0;
+	tio.c_lflag = opts->canonical ? ICANON : 0;
+	tio.c_cc[VTIME] = opts->vtime;
+	tio.c_cc[VMIN] = opts->vmin;
+	cfsetispeed(&tio, brate);
+	cfsetospeed(&tio, brate);
+
+	tcflush(fd, TCIFLUSH);
+	if (tcsetattr(fd, TCSANOW, &tio) == -1) {
+		perror("tcsetattr");
+		return 0;
+	}
+
+	return 1;
+}
+#endif
+
+/* Returns the configured fd or -1 */
+int serial_open(char *device, struct serial_opts *opts)
+{
+	int fd;
+
+	if ((opts->vmin < 0) || (opts->vmin > 255) ||
+	    (opts->vtime < 0) || (opts->vtime > 255)) {
+		fprintf(stderr, "Invalid VMIN/VTIME: %d/%d\n", opts->vmin, opts->vtime);
+		return -1;
+	}
+
+	fd = open(device, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror("open(serial)");
+		return -1;
+	}
+
+	if (!serial_setup(fd, opts)) {
+		close(fd);
+		return -1;
+	}
+
+	/* Not every driver (e.g. a pty) has it, so this is not fatal */
+	if (opts->low_latency && (!serial_set_low_latency(fd, 1)))
+		opts->low_latency = 0;
+
+	if (opts->read_chunk <= 0)
+		opts->read_chunk = SERIAL_DEFAULT_READ_CHUNK;
+
+	return fd;
+}
+
+uint64_t serial_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+void serial_latency_add(struct serial_latency *l, uint64_t us)
+{
+	if ((!l->n) || (us < l->min))
+		l->min = us;
+	if (us > l->max)
+		l->max = us;
+	l->sum += us;
+	l->n++;
+}
+
+void serial_latency_print(char *name, struct serial_latency *l)
+{
+	if (!l->n)
+		return;
+
+	fprintf(stderr, "%s round trip: %lu, min/avg/max %.1f/%.1f/%.1f ms\n", name, l->n,
+		l->min / 1000.0, (l->sum / (double)l->n) / 1000.0, l->max / 1000.0);
+}
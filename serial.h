@@ -0,0 +1,52 @@
+/* serial port setup
+ *
+ * Copyright (c) 2013-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define SERIAL_DEFAULT_READ_CHUNK	1024
+
+/* getopt string of the options handled by serial_opts_getopt() */
+#define SERIAL_GETOPT	"m:nr:t:"
+
+struct serial_opts {
+	uint32_t speed;		/* bps, any rate the driver accepts on Linux */
+	int canonical;		/* let the line discipline split lines */
+	int vmin;
+	int vtime;		/* 1/10 s */
+	int low_latency;	/* ask the driver for ASYNC_LOW_LATENCY */
+	int read_chunk;		/* max bytes per read() */
+};
+
+struct serial_latency {
+	unsigned long n;
+	uint64_t sum;		/* us */
+	uint64_t min;
+	uint64_t max;
+};
+
+void serial_opts_init(struct serial_opts *opts, uint32_t speed);
+void serial_opts_syntax(void);
+int serial_opts_getopt(struct serial_opts *opts, int opt, char *arg);
+int serial_open(char *device, struct serial_opts *opts);
+int serial_set_low_latency(int fd, int enable);
+uint64_t serial_now_us(void);
+void serial_latency_add(struct serial_latency *l, uint64_t us);
+void serial_latency_print(char *name, struct serial_latency *l);
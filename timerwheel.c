@@ -0,0 +1,165 @@
+/* hashed timer wheel
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "timerwheel.h"
+
+uint64_t timerwheel_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+void timerwheel_init(struct timerwheel *tw)
+{
+	memset(tw, 0, sizeof(struct timerwheel));
+	tw->last = timerwheel_now() / TIMERWHEEL_TICK_MS;
+}
+
+void timer_init(struct timer *t, timer_fn fn, void *data)
+{
+	memset(t, 0, sizeof(struct timer));
+	t->fn = fn;
+	t->data = data;
+}
+
+int timer_pending(struct timer *t)
+{
+	return (t->pprev != NULL);
+}
+
+void timer_del(struct timer *t)
+{
+	if (!t->pprev)
+		return;
+
+	*(t->pprev) = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* (Re-)arm t to expire in ms milliseconds */
+void timer_add(struct timerwheel *tw, struct timer *t, int ms)
+{
+	struct timer **head;
+	uint64_t tick;
+
+	timer_del(t);
+
+	if (ms < 0)
+		ms = 0;
+
+	/* Round up to the next tick, timers never expire early */
+	tick = (timerwheel_now() + ms + TIMERWHEEL_TICK_MS - 1) / TIMERWHEEL_TICK_MS;
+
+	/* Never hash into a tick which was already run */
+	if (tick <= tw->last)
+		tick = tw->last + 1;
+
+	t->expires = tick * TIMERWHEEL_TICK_MS;
+
+	head = &(tw->slot[tick % TIMERWHEEL_SLOTS]);
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &(t->next);
+	t->pprev = head;
+	*head = t;
+}
+
+/* Milliseconds until the next timer expires, -1 if none is pending */
+int timerwheel_next(struct timerwheel *tw)
+{
+	uint64_t now = timerwheel_now();
+	uint64_t next = 0;
+	struct timer *t;
+	int i;
+
+	for (i = 0; i < TIMERWHEEL_SLOTS; i++) {
+		for (t = tw->slot[i]; t; t = t->next) {
+			if ((!next) || (t->expires < next))
+				next = t->expires;
+		}
+	}
+
+	if (!next)
+		return -1;
+
+	if (next <= now)
+		return 0;
+
+	if ((next - now) > INT32_MAX)
+		return INT32_MAX;
+
+	return next - now;
+}
+
+/* Run all expired timers, returns how many were run */
+int timerwheel_run(struct timerwheel *tw)
+{
+	uint64_t now = timerwheel_now();
+	uint64_t tick = now / TIMERWHEEL_TICK_MS;
+	uint64_t t_tick;
+	struct timer *t, *next;
+	int run = 0;
+
+	/* Visit every slot at most once per call */
+	t_tick = tw->last;
+	if ((tick - t_tick) > TIMERWHEEL_SLOTS)
+		t_tick = tick - TIMERWHEEL_SLOTS;
+
+	while (t_tick < tick) {
+		t_tick++;
+
+		/* Timers re-armed from a callback go into a later slot */
+		tw->last = t_tick;
+
+		for (t = tw->slot[t_tick % TIMERWHEEL_SLOTS]; t; t = next) {
+			next = t->next;
+
+			/* Later round of the wheel */
+			if (t->expires > now)
+				continue;
+
+			timer_del(t);
+			t->fn(t, t->data);
+			run++;
+
+			/* The callback may have modified the list */
+			next = tw->slot[t_tick % TIMERWHEEL_SLOTS];
+		}
+	}
+
+	tw->last = tick;
+
+	return run;
+}
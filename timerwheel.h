@@ -0,0 +1,51 @@
+/* hashed timer wheel
+ *
+ * Copyright (c) 2014-16 Michael Gernoth <michael@gernoth.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define TIMERWHEEL_SLOTS	64
+#define TIMERWHEEL_TICK_MS	10
+
+struct timer;
+
+typedef void (*timer_fn)(struct timer *t, void *data);
+
+struct timer {
+	struct timer *next;
+	struct timer **pprev;	/* NULL: not pending */
+	uint64_t expires;	/* CLOCK_MONOTONIC, ms */
+	timer_fn fn;
+	void *data;
+};
+
+struct timerwheel {
+	struct timer *slot[TIMERWHEEL_SLOTS];
+	uint64_t last;	/* last tick which was run */
+};
+
+uint64_t timerwheel_now(void);
+void timerwheel_init(struct timerwheel *tw);
+int timerwheel_next(struct timerwheel *tw);
+int timerwheel_run(struct timerwheel *tw);
+void timer_init(struct timer *t, timer_fn fn, void *data);
+void timer_add(struct timerwheel *tw, struct timer *t, int ms);
+void timer_del(struct timer *t);
+int timer_pending(struct timer *t);
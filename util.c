@@ -22,6 +22,28 @@
  */
 
 #include <inttypes.h>
+#include <string.h>
+
+#include "util.h"
+
+#define HEX_CHAR(n)	((n) < 10 ? '0' + (n) : 'A' + (n) - 10)
+#define HEX_2(n)	{ HEX_CHAR((n) >> 4), HEX_CHAR((n) & 0xf) }
+#define HEX_8(n)	HEX_2(n), HEX_2(n + 1), HEX_2(n + 2), HEX_2(n + 3), \
+			HEX_2(n + 4), HEX_2(n + 5), HEX_2(n + 6), HEX_2(n + 7)
+#define HEX_64(n)	HEX_8(n), HEX_8(n + 8), HEX_8(n + 16), HEX_8(n + 24), \
+			HEX_8(n + 32), HEX_8(n + 40), HEX_8(n + 48), HEX_8(n + 56)
+
+static const char hex_lut[256][2] = { HEX_64(0), HEX_64(64), HEX_64(128), HEX_64(192) };
+
+#define REP8(x)		(0x0101010101010101ULL * (x))
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define LE64(x)		__builtin_bswap64(x)
+#define LE32(x)		__builtin_bswap32(x)
+#else
+#define LE64(x)		(x)
+#define LE32(x)		(x)
+#endif
 
 uint8_t ascii_to_nibble(uint8_t a)
 {
@@ -55,3 +77,73 @@ char nibble_to_ascii(uint8_t n)
 
 	return nibble[n];
 }
+
+/* Writes 2 * len uppercase hex characters (no terminator) to out,
+ * 4 input bytes at a time in a 64 bit register. */
+int hex_encode(char *out, const uint8_t *in, int len)
+{
+	char *o = out;
+	uint64_t x, n, ten;
+	uint32_t w;
+
+	for (; len >= 4; len -= 4, in += 4, o += 8) {
+		memcpy(&w, in, 4);
+		x = LE32(w);
+
+		/* Spread the bytes into 16 bit lanes, high nibble first */
+		x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+		x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+		n = ((x >> 4) & 0x000f000f000f000fULL) | ((x & 0x000f000f000f000fULL) << 8);
+
+		/* '0' + n, plus 7 more for 'A'..'F' */
+		ten = ((n + REP8(0x06)) >> 4) & REP8(0x01);
+		x = LE64(n + REP8('0') + (ten * 7));
+		memcpy(o, &x, 8);
+	}
+
+	for (; len; len--, o += 2)
+		memcpy(o, hex_lut[*in++], 2);
+
+	return o - out;
+}
+
+/* Decodes len hex characters (either case) from in into len / 2 bytes,
+ * 8 characters at a time in a 64 bit register. Stops at the first pair
+ * containing anything but a hex digit and returns the number of bytes
+ * decoded so far, callers compare this to what they expected. A trailing
+ * odd character is ignored. */
+int hex_decode_validate(uint8_t *out, const uint8_t *in, int len)
+{
+	uint8_t *o = out;
+	uint64_t v, l, digit, alpha, n;
+	uint32_t w;
+
+	for (; len >= 8; len -= 8, in += 8, o += 4) {
+		memcpy(&v, in, 8);
+		v = LE64(v);
+
+		/* High bit of each lane set when '0'..'9' resp. 'a'..'f' */
+		digit = (v + REP8(0x80 - '0')) & ~(v + REP8(0x80 - '9' - 1));
+		l = v | REP8(0x20);
+		alpha = (l + REP8(0x80 - 'a')) & ~(l + REP8(0x80 - 'f' - 1));
+		if ((v & REP8(0x80)) || (((digit | alpha) & REP8(0x80)) != REP8(0x80)))
+			break;
+
+		n = (v & REP8(0x0f)) + ((alpha >> 7) & REP8(0x01)) * 9;
+
+		/* Combine nibble pairs, then pack the 4 resulting bytes */
+		n = ((n & 0x00ff00ff00ff00ffULL) << 4) | ((n >> 8) & 0x00ff00ff00ff00ffULL);
+		n = (n | (n >> 8)) & 0x0000ffff0000ffffULL;
+		n = (n | (n >> 16)) & 0xffffffffULL;
+		w = LE32((uint32_t)n);
+		memcpy(o, &w, 4);
+	}
+
+	for (; len >= 2; len -= 2, in += 2) {
+		if ((!validate_nibble(in[0])) || (!validate_nibble(in[1])))
+			break;
+		*o++ = (ascii_to_nibble(in[0]) << 4) | ascii_to_nibble(in[1]);
+	}
+
+	return o - out;
+}
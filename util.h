@@ -24,3 +24,5 @@
 uint8_t ascii_to_nibble(uint8_t a);
 int validate_nibble(uint8_t a);
 char nibble_to_ascii(uint8_t n);
+int hex_encode(char *out, const uint8_t *in, int len);
+int hex_decode_validate(uint8_t *out, const uint8_t *in, int len);